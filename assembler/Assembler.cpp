@@ -249,6 +249,10 @@ void Assembler::parse_rtype(Funct funct)
         instructions.push_back(string_inst(funct));
         return;
     }
+    case Funct::SYNC:
+        write_rtype(Register::ZERO, Register::ZERO, Register::ZERO, 0, funct);
+        instructions.push_back(string_inst(funct));
+        return;
     default:
         throw Parse_error("Unimplemented");
     }
@@ -373,7 +377,9 @@ void Assembler::parse_itype(Opcode opcode)
     case Opcode::SH:
     case Opcode::SWL:
     case Opcode::SW:
-    case Opcode::SWR: {
+    case Opcode::SWR:
+    case Opcode::LL:
+    case Opcode::SC: {
         auto dest = get<Register>(consume(Tag::Register));
         int offset = 0;
 
@@ -68,11 +68,14 @@ const std::unordered_map<std::string, Tag> reserved_words { //NOLINT
         {"sb",      Tag::Instruction},
         {"sh",      Tag::Instruction},
         {"sw",      Tag::Instruction},
+        {"ll",      Tag::Instruction},
+        {"sc",      Tag::Instruction},
         {"mfhi",    Tag::Instruction},
         {"mflo",    Tag::Instruction},
         {"mtlo",    Tag::Instruction},
         {"mthi",    Tag::Instruction},
         {"syscall", Tag::Instruction},
+        {"sync",    Tag::Instruction},
         {"move",    Tag::Instruction},
         {"li",      Tag::Instruction},
         {".align",  Tag::Directive},
@@ -0,0 +1,51 @@
+#ifndef MIPS_EXECUTABLE_H
+#define MIPS_EXECUTABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Binary executable written by the linker and mapped by the VM.
+//
+// The file starts with this header. The text and data sections follow at
+// file offsets aligned to `alignment`, so either can be mapped straight from
+// the file. In guest memory the text is loaded at address 0 and the data
+// immediately after it; the program break is the end of the data.
+struct ExecutableHeader {
+    enum : uint32_t {
+        magic_value = 0x5850494D, // "MIPX"
+        current_version = 1,
+        alignment = 4096,
+    };
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry;         // byte address of the first instruction
+    uint32_t text_offset;   // file offset of the text section
+    uint32_t text_size;     // in bytes
+    uint32_t data_offset;   // file offset of the data section
+    uint32_t data_size;     // in bytes
+    uint32_t reserved;
+};
+
+inline uint32_t align_up(uint32_t value, uint32_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// True when data holds a complete binary executable of a version we read,
+// with its entry point inside the text.
+inline bool is_executable(const void* data, size_t size)
+{
+    ExecutableHeader header;
+    if (size < sizeof header)
+        return false;
+    memcpy(&header, data, sizeof header);
+    return header.magic == ExecutableHeader::magic_value
+           && header.version == ExecutableHeader::current_version
+           && header.entry < header.text_size
+           && header.text_offset + static_cast<size_t>(header.text_size) <= size
+           && header.data_offset + static_cast<size_t>(header.data_size) <= size;
+}
+
+#endif //MIPS_EXECUTABLE_H
@@ -31,6 +31,7 @@ const std::unordered_map<std::string, Funct,
         {"mtlo",    Funct::MTHI},
         {"mthi",    Funct::MTHI},
         {"syscall", Funct::SYSCALL},
+        {"sync",    Funct::SYNC},
 };
 
 std::ostream& operator<<(std::ostream& os, Funct funct)
@@ -54,6 +55,8 @@ std::ostream& operator<<(std::ostream& os, Funct funct)
         return os << "jalr";
     case Funct::SYSCALL:
         return os << "syscall";
+    case Funct::SYNC:
+        return os << "sync";
     case Funct::MFHI:
         return os << "mfhi";
     case Funct::MTHI:
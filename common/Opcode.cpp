@@ -48,11 +48,14 @@ const std::unordered_map<std::string, Opcode,
         {"sb",      Opcode::SB},
         {"sh",      Opcode::SH},
         {"sw",      Opcode::SW},
+        {"ll",      Opcode::LL},
+        {"sc",      Opcode::SC},
         {"mfhi",    Opcode::R_TYPE},
         {"mflo",    Opcode::R_TYPE},
         {"mtlo",    Opcode::R_TYPE},
         {"mthi",    Opcode::R_TYPE},
         {"syscall", Opcode::R_TYPE},
+        {"sync",    Opcode::R_TYPE},
         {"li",      Opcode::LI},
         {"move",    Opcode::MOVE},
         {"la",      Opcode::LA},
@@ -113,6 +116,10 @@ std::ostream& operator<<(std::ostream& os, Opcode code)
         return os << "sw";
     case Opcode::SWR:
         return os << "swr";
+    case Opcode::LL:
+        return os << "ll";
+    case Opcode::SC:
+        return os << "sc";
     case Opcode::LI:
         return os << "li";
     case Opcode::MOVE:
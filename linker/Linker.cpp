@@ -3,8 +3,10 @@
 #include <sstream>
 #include <regex>
 #include <iomanip>
+#include <algorithm>
 #include <Form.h>
 #include <Bitmask.h>
+#include <Executable.h>
 
 #include "Linker.h"
 
@@ -26,7 +28,7 @@ std::string chop_file_extension(const char* cstr)
 int main(int argc, char** argv)
 {
     if (argc < 2) {
-        std::cerr << "usage: " << argv[0] << "file(s) ...\n";
+        std::cerr << "usage: " << argv[0] << " [-t] [-o output] file(s) ...\n";
         return 1;
     }
     return Linker{}.link(argc, argv);
@@ -42,6 +44,10 @@ int Linker::link(int argc, char** argv)
             i += 1;
             continue;
         }
+        if (strcmp(arg, "-t") == 0) {
+            text_output = true;
+            continue;
+        }
         std::ifstream input(arg);
         if (input.is_open()) {
             offsets.emplace_back(
@@ -58,8 +64,21 @@ int Linker::link(int argc, char** argv)
 
     relocate_references();
 
+    std::ofstream output(output_name, std::ios_base::trunc | std::ios_base::binary);
+    if (text_output)
+        write_text(output);
+    else
+        write_binary(output);
+
+    std::ofstream symbols(std::string(output_name) + ".sym", std::ios_base::trunc);
+    write_symbols(symbols);
+    return 0;
+}
+
+// One hex word per line after a header naming the segment addresses.
+void Linker::write_text(std::ostream& output)
+{
     Form word(6, std::ios_base::hex, 8, '0');
-    std::ofstream output(output_name, std::ios_base::trunc);
     output << ".text " << word(text_start << 2)
            << " .data " << word(data_start << 2)
            << " length " << word(static_cast<int>(linked.size() << 2)) << '\n';
@@ -67,7 +86,45 @@ int Linker::link(int argc, char** argv)
     for (int i = 0; i < linked.size(); ++i) {
         output << word(linked[i]) << '\n';
     }
-    return 0;
+}
+
+// See Executable.h for the layout.
+void Linker::write_binary(std::ostream& output)
+{
+    ExecutableHeader header{};
+    header.magic = ExecutableHeader::magic_value;
+    header.version = ExecutableHeader::current_version;
+    header.entry = static_cast<uint32_t>(text_start << 2);
+    header.text_offset = ExecutableHeader::alignment;
+    header.text_size = static_cast<uint32_t>(data_start << 2);
+    header.data_offset = align_up(header.text_offset + header.text_size, ExecutableHeader::alignment);
+    header.data_size = static_cast<uint32_t>((linked.size() - data_start) << 2);
+
+    auto pad_to = [&output](uint32_t offset) {
+        while (static_cast<uint32_t>(output.tellp()) < offset)
+            output.put('\0');
+    };
+
+    output.write(reinterpret_cast<const char*>(&header), sizeof header);
+    pad_to(header.text_offset);
+    output.write(reinterpret_cast<const char*>(linked.data()), header.text_size);
+    pad_to(header.data_offset);
+    output.write(reinterpret_cast<const char*>(linked.data() + data_start), header.data_size);
+}
+
+// The global text symbols, one "address name" line each in address order,
+// for tools that need to name code addresses in the linked program.
+void Linker::write_symbols(std::ostream& output)
+{
+    std::vector<std::pair<uint32_t, std::string>> symbols;
+    for (auto& i : globals)
+        if (i.second.segment == Segment::Text)
+            symbols.emplace_back(i.second.address, i.first);
+    std::sort(symbols.begin(), symbols.end());
+
+    Form word(6, std::ios_base::hex, 8, '0');
+    for (auto& symbol : symbols)
+        output << word(symbol.first) << ' ' << symbol.second << '\n';
 }
 
 void Linker::relocate_references()
@@ -95,6 +95,7 @@ struct Linker {
     std::vector<uint32_t> linked;
     int text_start;
     int data_start;
+    bool text_output{false};
 
     // Symbol offset
     std::vector<Offset> offsets;
@@ -110,6 +111,9 @@ struct Linker {
     void read_symbol_line(std::istream& input);
     void read_relocation_line(std::istream& input);
     void relocate_references();
+    void write_text(std::ostream& output);
+    void write_binary(std::ostream& output);
+    void write_symbols(std::ostream& output);
     void resolve(SymbolInfo&, RelocationInfo&);
 };
 
@@ -0,0 +1,569 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <unistd.h>
+
+#include "Translator.h"
+
+std::string chop_file_extension(const char* cstr)
+{
+    std::string str(cstr);
+    auto dot = str.find('.');
+    if (dot != std::string::npos)
+        str.erase(str.begin() + dot, str.end());
+    return str;
+}
+
+int main(int argc, char** argv)
+{
+    const char* input_name = nullptr;
+    std::string output_name;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_name = argv[i + 1];
+            i += 1;
+            continue;
+        }
+        input_name = argv[i];
+    }
+    if (!input_name) {
+        std::cerr << "usage: " << argv[0] << " [-o output.cpp] file\n";
+        return 1;
+    }
+    if (output_name.empty())
+        output_name = chop_file_extension(input_name) + ".cpp";
+
+    if (access(input_name, R_OK) != 0) {
+        std::cerr << "Couldn't open file.\n";
+        return 1;
+    }
+    Translator translator{std::string(input_name)};
+    std::ofstream output(output_name, std::ios_base::trunc);
+    translator.translate(output);
+    return 0;
+}
+
+Translator::Translator(const std::string& path)
+        : vm(path), text_end(static_cast<uint32_t>(vm.memory.data_segment))
+{
+    // Keep the plain decoding, superinstructions are the host compiler's job.
+    vm.fuse = false;
+    vm.decode_text();
+}
+
+void Translator::translate(std::ostream& output)
+{
+    emit_prelude(output);
+    emit_image(output);
+
+    output << "static int run(uint8_t* mem, uint32_t* r, uint32_t pc, uint32_t hart)\n"
+           << "{\n"
+           << "    uint32_t hi = 0, lo = 0;\n"
+           << "    int status = 0;\n"
+           << "    goto dispatch;\n\n";
+
+    for (uint32_t pc = 0; pc < text_end; ++pc)
+        emit_instruction(output, pc, vm.text[pc]);
+
+    output << "halt:\n"
+           << "    if (hart == 0)\n"
+           << "        dump(r);\n"
+           << "    return 0;\n\n";
+    emit_dispatch(output);
+    output << "}\n\n";
+
+    output << "int main()\n"
+           << "{\n"
+           << "    std::vector<uint8_t> memory(stack_segment * 4);\n"
+           << "    memcpy(memory.data(), image, sizeof image);\n"
+           << "    uint32_t r[32] = {};\n"
+           << "    r[29] = stack_segment - 1;\n"
+           << "    try {\n"
+           << "        return run(memory.data(), r, " << vm.program_counter << ", 0);\n"
+           << "    } catch (const std::exception& e) {\n"
+           << "        std::cerr << e.what() << '\\n';\n"
+           << "        return 1;\n"
+           << "    }\n"
+           << "}\n";
+}
+
+void Translator::emit_prelude(std::ostream& output)
+{
+    output << "// Translated from a mips executable, do not edit.\n"
+           << "#include <cstdint>\n"
+           << "#include <cstdio>\n"
+           << "#include <cstdlib>\n"
+           << "#include <cstring>\n"
+           << "#include <iomanip>\n"
+           << "#include <iostream>\n"
+
+           << "#include <stdexcept>\n"
+           << "#include <string>\n"
+           << "#include <vector>\n\n";
+
+    output << "static const char* const names[32] = {";
+    for (size_t i = 0; i < 32; ++i) {
+        std::stringstream name;
+        name << static_cast<Register>(i);
+        output << (i % 8 ? " " : "\n    ") << '"' << name.str() << "\",";
+    }
+    output << "\n};\n\n";
+
+    output << "static const uint32_t stack_segment = " << vm.memory.stack_segment << ";\n"
+           << "static const uint32_t text_end = " << text_end << ";\n\n";
+
+    // Same layout as operator<<(std::ostream&, const RegisterFile&) in the VM.
+    output << R"(static void dump(const uint32_t* r)
+{
+    for (int i = 0; i < 32;) {
+        std::cout << std::setw(5) << std::left << names[i] << std::right << " "
+                  << std::hex << std::setw(8) << std::setfill('0') << r[i]
+                  << std::dec << std::setfill(' ') << "   ";
+        i += 1;
+        if (i % 8 == 0)
+            std::cout << '\n';
+    }
+}
+
+static const uint64_t memory_size = uint64_t{stack_segment} * 4;
+
+// Guest accesses outside memory fault with the VM's MemoryFault message.
+[[noreturn]] static void fault(uint64_t address)
+{
+    char message[48];
+    snprintf(message, sizeof message, "Memory fault at address %#llx", static_cast<unsigned long long>(address));
+    throw std::runtime_error(message);
+}
+
+// Faults where a byte-by-byte guest loop over [address, address + size)
+// would, like VM::check_range.
+static void check(uint32_t address, uint64_t size)
+{
+    if (size == 0)
+        return;
+    if (address >= memory_size)
+        fault(address);
+    if (address + size > memory_size)
+        fault(memory_size);
+}
+
+// Guest memory is byte addressed and little-endian, like the host.
+template<class T>
+static T load(const uint8_t* mem, uint32_t address)
+{
+    check(address, sizeof(T));
+    T value;
+    memcpy(&value, mem + address, sizeof value);
+    return value;
+}
+
+template<class T>
+static void store(uint8_t* mem, uint32_t address, T value)
+{
+    check(address, sizeof(T));
+    memcpy(mem + address, &value, sizeof value);
+}
+
+// LL and SC fault on addresses that aren't word aligned, as on the VM.
+static uint32_t atomic_address(uint32_t address)
+{
+    if (address & 3)
+        fault(address);
+    return address;
+}
+
+// Length of the NUL-terminated string at address, like VM::string_length.
+static uint32_t string_length(const uint8_t* mem, uint32_t address)
+{
+    if (address >= memory_size)
+        fault(address);
+    auto end = static_cast<const uint8_t*>(memchr(mem + address, 0, memory_size - address));
+    if (!end)
+        fault(memory_size);
+    return static_cast<uint32_t>(end - (mem + address));
+}
+
+// DIV and DIVU as divide() and divide_unsigned() in the VM define them.
+static void divide(uint32_t rs, uint32_t rt, uint32_t& hi, uint32_t& lo)
+{
+    auto dividend = static_cast<int32_t>(rs);
+    auto divisor = static_cast<int32_t>(rt);
+    if (divisor == 0) {
+        lo = 0;
+        hi = rs;
+    } else if (divisor == -1) {
+        lo = 0u - rs;
+        hi = 0;
+    } else {
+        lo = static_cast<uint32_t>(dividend / divisor);
+        hi = static_cast<uint32_t>(dividend % divisor);
+    }
+}
+
+static void divide_unsigned(uint32_t rs, uint32_t rt, uint32_t& hi, uint32_t& lo)
+{
+    if (rt == 0) {
+        lo = 0;
+        hi = rs;
+    } else {
+        lo = rs / rt;
+        hi = rs % rt;
+    }
+}
+
+static void self_modified(uint32_t index)
+{
+    std::cerr << "store into translated text at " << index << '\n';
+    exit(3);
+}
+
+static int run(uint8_t* mem, uint32_t* r, uint32_t pc, uint32_t hart);
+
+// Exit statuses of the harts spawned so far, hart n at n - 1.
+static std::vector<int> harts;
+
+// The syscalls of VM::syscall. Returns true when the hart exits.
+static bool syscall(uint32_t* r, uint8_t* mem, uint32_t hart, int& status)
+{
+    switch (r[2]) {
+    case 1:
+        std::cout << r[4];
+        break;
+    case 4: {
+        uint32_t length = string_length(mem, r[4]);
+        for (uint32_t i = 0; i < length; ++i)
+            putchar(mem[r[4] + i]);
+        break;
+    }
+    case 5:
+        std::cin >> r[2];
+        break;
+    case 10:
+        if (hart == 0)
+            dump(r);
+        status = 0;
+        return true;
+    case 11:
+        std::cout << static_cast<char>(r[4]);
+        break;
+    case 12: {
+        uint8_t value = static_cast<uint8_t>(r[2]);
+        std::cin >> value;
+        r[2] = (r[2] & ~0xFFu) | value;
+        break;
+    }
+    case 17:
+        if (hart == 0)
+            dump(r);
+        status = static_cast<int>(r[4]);
+        return true;
+    case 40:
+        check(r[5], r[6]);
+        check(r[4], r[6]);
+        if (r[6] && r[4] < text_end * 4)
+            self_modified(r[4] >> 2);
+        memmove(mem + r[4], mem + r[5], r[6]);
+        r[2] = r[4];
+        break;
+    case 41:
+        check(r[4], r[6]);
+        if (r[6] && r[4] < text_end * 4)
+            self_modified(r[4] >> 2);
+        memset(mem + r[4], static_cast<uint8_t>(r[5]), r[6]);
+        r[2] = r[4];
+        break;
+    case 42: {
+        check(r[4], r[6]);
+        check(r[5], r[6]);
+        int result = memcmp(mem + r[4], mem + r[5], r[6]);
+        r[2] = static_cast<uint32_t>((result > 0) - (result < 0));
+        break;
+    }
+    case 43:
+        r[2] = string_length(mem, r[4]);
+        break;
+    case 44: {
+        check(r[4], r[6]);
+        auto found = static_cast<const uint8_t*>(memchr(mem + r[4], static_cast<uint8_t>(r[5]), r[6]));
+        r[2] = found ? static_cast<uint32_t>(found - mem) : 0;
+        break;
+    }
+    // There is no VM state to save, so snapshots fail the way an unwritable
+    // file makes them fail on the VM.
+    case 50:
+        std::cerr << "snapshots are not supported by translated programs\n";
+        r[2] = static_cast<uint32_t>(-1);
+        break;
+    // Harts run one at a time: a spawned hart runs to its end before spawn
+    // returns, and joining it just reads its status.
+    case 60: {
+        uint32_t entry = r[4] / 4;
+        if (entry >= text_end) {
+            r[2] = static_cast<uint32_t>(-1);
+            break;
+        }
+        uint32_t child[32];
+        memcpy(child, r, sizeof child);
+        child[4] = r[5];
+        child[29] = r[6];
+        child[31] = text_end;
+        auto id = static_cast<uint32_t>(harts.size() + 1);
+        harts.push_back(0);
+        int result;
+        try {
+            result = run(mem, child, entry, id);
+        } catch (const std::exception& e) {
+            std::cerr << "hart " << id << ": " << e.what() << '\n';
+            result = -1;
+        }
+        harts[id - 1] = result;
+        r[2] = id;
+        break;
+    }
+    case 61:
+        r[2] = static_cast<uint32_t>(r[4] != hart && r[4] - 1 < harts.size() ? harts[r[4] - 1] : -1);
+        break;
+    }
+    return false;
+}
+
+)";
+}
+
+void Translator::emit_image(std::ostream& output)
+{
+    output << "static const uint32_t image[] = {";
+    for (size_t i = 0; i < vm.memory.program_break; ++i) {
+        output << (i % 8 ? " " : "\n    ")
+               << "0x" << std::hex << std::setw(8) << std::setfill('0') << vm.memory[i].word
+               << std::dec << std::setfill(' ') << ',';
+    }
+    output << "\n};\n\n";
+}
+
+// Where control goes for a transfer to pc: its label, or the end of the
+// program for anything past the text segment.
+std::string Translator::target(uint32_t pc)
+{
+    return pc < text_end ? "L" + std::to_string(pc) : "halt";
+}
+
+void Translator::emit_instruction(std::ostream& output, uint32_t pc, const Instruction& inst)
+{
+    const std::string s = "r[" + std::to_string(inst.rs) + "]";
+    const std::string t = "r[" + std::to_string(inst.rt) + "]";
+    const std::string d = "r[" + std::to_string(inst.rd) + "]";
+    const std::string imm = std::to_string(inst.immediate);
+    const std::string uimm = std::to_string(static_cast<uint32_t>(inst.immediate)) + "u";
+    const uint32_t next = pc + 1;
+
+    output << "L" << pc << ":\n    ";
+    switch (inst.op) {
+    case Operation::SLL:
+        output << d << " = " << t << " << " << imm << ";";
+        break;
+    case Operation::SRL:
+        output << d << " = " << t << " >> " << imm << ";";
+        break;
+    case Operation::SRA:
+        output << d << " = static_cast<uint32_t>(static_cast<int32_t>(" << t << ") >> " << imm << ");";
+        break;
+    case Operation::SLLV:
+        output << d << " = " << s << " << (" << t << " & 31);";
+        break;
+    case Operation::SRLV:
+        output << d << " = " << s << " >> (" << t << " & 31);";
+        break;
+    case Operation::SRAV:
+        output << d << " = static_cast<uint32_t>(static_cast<int32_t>(" << s << ") >> (" << t << " & 31));";
+        break;
+    case Operation::JR:
+    case Operation::JALR:
+        output << "pc = " << s << ";\n    goto dispatch;";
+        break;
+    case Operation::SYSCALL:
+        output << "if (syscall(r, mem, hart, status))\n        return status;";
+        break;
+    case Operation::SYNC:
+        output << ";";
+        break;
+    case Operation::MFHI:
+        output << d << " = hi;";
+        break;
+    case Operation::MTHI:
+        output << "hi = " << s << ";";
+        break;
+    case Operation::MFLO:
+        output << d << " = lo;";
+        break;
+    case Operation::MTLO:
+        output << "lo = " << s << ";";
+        break;
+    case Operation::MULT:
+        output << "{\n"
+               << "        int64_t result = int64_t{static_cast<int32_t>(" << s << ")} * static_cast<int32_t>(" << t << ");\n"
+               << "        hi = static_cast<uint32_t>(static_cast<uint64_t>(result) >> 32);\n"
+               << "        lo = static_cast<uint32_t>(result);\n"
+               << "    }";
+        break;
+    case Operation::MULTU:
+        output << "{\n"
+               << "        uint64_t result = uint64_t{" << s << "} * " << t << ";\n"
+               << "        hi = static_cast<uint32_t>(result >> 32);\n"
+               << "        lo = static_cast<uint32_t>(result);\n"
+               << "    }";
+        break;
+    case Operation::DIV:
+        output << "divide(" << s << ", " << t << ", hi, lo);";
+        break;
+    case Operation::DIVU:
+        output << "divide_unsigned(" << s << ", " << t << ", hi, lo);";
+        break;
+    case Operation::ADD:
+    case Operation::ADDU:
+        output << d << " = " << s << " + " << t << ";";
+        break;
+    case Operation::SUB:
+    case Operation::SUBU:
+        output << d << " = " << s << " - " << t << ";";
+        break;
+    case Operation::AND:
+        output << d << " = " << s << " & " << t << ";";
+        break;
+    case Operation::OR:
+        output << d << " = " << s << " | " << t << ";";
+        break;
+    case Operation::XOR:
+        output << d << " = " << s << " ^ " << t << ";";
+        break;
+    case Operation::NOR:
+        output << d << " = !(" << s << " | " << t << ");";
+        break;
+    case Operation::SLT:
+    case Operation::SLTU:
+        output << d << " = " << s << " < " << t << ";";
+        break;
+    case Operation::J:
+        output << "goto " << target(static_cast<uint32_t>(inst.immediate)) << ";";
+        break;
+    case Operation::J_OUT_OF_BOUNDS:
+        output << "std::cerr << \"jump out of bounds \\n\";\n    exit(2);";
+        break;
+    case Operation::JAL:
+        output << "r[31] = " << next << ";\n    goto " << target(static_cast<uint32_t>(inst.immediate)) << ";";
+        break;
+    case Operation::BEQ:
+        output << "if (" << s << " == " << t << ")\n        goto " << target(next + inst.immediate) << ";";
+        break;
+    case Operation::BNE:
+        output << "if (" << s << " != " << t << ")\n        goto " << target(next + inst.immediate) << ";";
+        break;
+    case Operation::ADDI:
+    case Operation::ADDIU:
+        output << t << " = " << s << " + " << uimm << ";";
+        break;
+    case Operation::SLTI:
+    case Operation::SLTIU:
+        output << t << " = " << s << " < " << uimm << ";";
+        break;
+    case Operation::ANDI:
+        output << t << " = " << s << " & " << uimm << ";";
+        break;
+    case Operation::ORI:
+        output << t << " = " << s << " | " << uimm << ";";
+        break;
+    case Operation::XORI:
+        output << t << " = " << s << " ^ " << uimm << ";";
+        break;
+    case Operation::LUI:
+        output << t << " = " << uimm << ";";
+        break;
+    case Operation::LB:
+        output << t << " = static_cast<int8_t>(load<uint8_t>(mem, " << s << " + " << uimm << "));";
+        break;
+    case Operation::LBU:
+        output << t << " = load<uint8_t>(mem, " << s << " + " << uimm << ");";
+        break;
+    case Operation::LH:
+        output << t << " = static_cast<int16_t>(load<uint16_t>(mem, (" << s << " + " << uimm << ") & ~1u));";
+        break;
+    case Operation::LHU:
+        output << t << " = load<uint16_t>(mem, (" << s << " + " << uimm << ") & ~1u);";
+        break;
+    case Operation::LW:
+        output << t << " = load<uint32_t>(mem, (" << s << " + " << uimm << ") & ~3u);";
+        break;
+    case Operation::LL:
+        output << t << " = load<uint32_t>(mem, atomic_address(" << s << " + " << uimm << "));";
+        break;
+    case Operation::LWL:
+    case Operation::LWR: {
+        bool left = inst.op == Operation::LWL;
+        output << "{\n"
+               << "        uint32_t address = " << s << " + " << uimm << ";\n"
+               << "        uint32_t shift = " << (left ? "(3 - (address & 3)) * 8" : "(address & 3) * 8") << ";\n"
+               << "        uint32_t word = load<uint32_t>(mem, address & ~3u);\n"
+               << "        " << t << " = (" << t << " & ~(0xFFFFFFFFu " << (left ? "<<" : ">>") << " shift))"
+               << " | (word " << (left ? "<<" : ">>") << " shift);\n"
+               << "    }";
+        break;
+    }
+    case Operation::SB:
+    case Operation::SH:
+    case Operation::SW: {
+        const char* type = inst.op == Operation::SB ? "uint8_t" : inst.op == Operation::SH ? "uint16_t" : "uint32_t";
+        const char* mask = inst.op == Operation::SB ? "" : inst.op == Operation::SH ? " & ~1u" : " & ~3u";
+        output << "{\n"
+               << "        uint32_t address = (" << s << " + " << uimm << ")" << mask << ";\n"
+               << "        store<" << type << ">(mem, address, static_cast<" << type << ">(" << t << "));\n"
+               << "        if ((address >> 2) < text_end)\n"
+               << "            self_modified(address >> 2);\n"
+               << "    }";
+        break;
+    }
+    // Translated programs run a single hart, so nothing can come between LL
+    // and SC.
+    case Operation::SC:
+        output << "{\n"
+               << "        uint32_t address = atomic_address(" << s << " + " << uimm << ");\n"
+               << "        store<uint32_t>(mem, address, " << t << ");\n"
+               << "        " << t << " = 1;\n"
+               << "        if ((address >> 2) < text_end)\n"
+               << "            self_modified(address >> 2);\n"
+               << "    }";
+        break;
+    case Operation::SWL:
+    case Operation::SWR: {
+        bool left = inst.op == Operation::SWL;
+        output << "{\n"
+               << "        uint32_t address = " << s << " + " << uimm << ";\n"
+               << "        uint32_t shift = " << (left ? "(3 - (address & 3)) * 8" : "(address & 3) * 8") << ";\n"
+               << "        uint32_t word = load<uint32_t>(mem, address & ~3u);\n"
+               << "        word = (word & ~(0xFFFFFFFFu " << (left ? ">>" : "<<") << " shift))"
+               << " | (" << t << " " << (left ? ">>" : "<<") << " shift);\n"
+               << "        store<uint32_t>(mem, address & ~3u, word);\n"
+               << "        if ((address >> 2) < text_end)\n"
+               << "            self_modified(address >> 2);\n"
+               << "    }";
+        break;
+    }
+    case Operation::UNSUPPORTED_R:
+        output << "throw std::runtime_error(\"Unsupported r-type operation at " << pc << "\");";
+        break;
+    default:
+        output << "throw std::runtime_error(\"Unsupported i-type operation at " << pc << "\");";
+        break;
+    }
+    output << '\n';
+}
+
+void Translator::emit_dispatch(std::ostream& output)
+{
+    output << "dispatch:\n"
+           << "    switch (pc) {\n";
+    for (uint32_t pc = 0; pc < text_end; ++pc)
+        output << "    case " << pc << ": goto L" << pc << ";\n";
+    output << "    default: goto halt;\n"
+           << "    }\n";
+}
@@ -0,0 +1,41 @@
+#ifndef TRANSLATOR_H
+#define TRANSLATOR_H
+
+#include <iosfwd>
+#include <string>
+
+#include <VM.h>
+
+// Ahead-of-time translation of a linked executable, binary or text, into a
+// C++ program that runs it the way the VM does, within the limits below.
+//
+// The executable is loaded and decoded by a VM instance, and every word of
+// the text segment becomes a labelled statement in one function. Straight
+// line code falls through from label to label, branches and jumps with a
+// known target are direct gotos, and jr/jalr go through a switch over every
+// text address, which the host compiler turns into a jump table.
+//
+// Every guest access is checked against guest memory and faults with the
+// VM's message, and division is defined as on the VM. Stores into the text
+// segment cannot be honoured once the code is compiled; the translated
+// program reports them and exits. Harts run one at a time, a
+// spawned hart to its end inside the spawn syscall, so guests that make a
+// hart wait for its parent don't translate. Snapshots report that they can't
+// be taken and fail.
+struct Translator {
+    explicit Translator(const std::string& path);
+
+    void translate(std::ostream& output);
+
+private:
+    VM vm;
+    uint32_t text_end;
+
+    void emit_prelude(std::ostream& output);
+    void emit_image(std::ostream& output);
+    void emit_instruction(std::ostream& output, uint32_t pc, const Instruction& inst);
+    void emit_dispatch(std::ostream& output);
+    std::string target(uint32_t pc);
+};
+
+#endif //TRANSLATOR_H
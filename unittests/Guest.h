@@ -0,0 +1,87 @@
+#ifndef MIPS_TESTS_GUEST_H
+#define MIPS_TESTS_GUEST_H
+
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <Funct.h>
+#include <Opcode.h>
+#include <Register.h>
+#include <VM.h>
+
+// Guest programs for the VM tests, put together word by word.
+namespace guest {
+
+inline uint32_t reg(Register r)
+{
+    return static_cast<uint32_t>(r);
+}
+
+inline uint32_t r_type(Funct funct, Register rs, Register rt, Register rd, uint32_t shamt = 0)
+{
+    return reg(rs) << 21 | reg(rt) << 16 | reg(rd) << 11 | (shamt & 31) << 6 | static_cast<uint32_t>(funct);
+}
+
+inline uint32_t i_type(Opcode opcode, Register rs, Register rt, int32_t immediate)
+{
+    return static_cast<uint32_t>(opcode) << 26 | reg(rs) << 21 | reg(rt) << 16
+           | (static_cast<uint32_t>(immediate) & 0xFFFF);
+}
+
+inline uint32_t j_type(Opcode opcode, uint32_t target)
+{
+    return static_cast<uint32_t>(opcode) << 26 | (target & 0x3FFFFFF);
+}
+
+inline uint32_t syscall()
+{
+    return r_type(Funct::SYSCALL, Register::ZERO, Register::ZERO, Register::ZERO);
+}
+
+// addiu rt, $zero, immediate: small constants.
+inline uint32_t li(Register rt, int16_t immediate)
+{
+    return i_type(Opcode::ADDIU, Register::ZERO, rt, immediate);
+}
+
+// A program in the linker's text format: the text, then the data right
+// after it, then room words of zeroes before the program break. The stack
+// gets as much again above that.
+inline std::string image(const std::vector<uint32_t>& text, const std::vector<uint32_t>& data = {},
+                         size_t room = 1024)
+{
+    size_t end = (text.size() + data.size() + room) * 4;
+    std::ostringstream out;
+    out << std::hex << std::setfill('0')
+        << ".text " << std::setw(8) << 0 << " .data " << std::setw(8) << text.size() * 4
+        << " length " << std::setw(8) << end << '\n';
+    for (uint32_t word : text)
+        out << std::setw(8) << word << '\n';
+    for (uint32_t word : data)
+        out << std::setw(8) << word << '\n';
+    return out.str();
+}
+
+inline std::unique_ptr<VM> load(const std::vector<uint32_t>& text, const std::vector<uint32_t>& data = {},
+                                size_t room = 1024)
+{
+    std::string program = image(text, data, room);
+    return std::unique_ptr<VM>(new VM(program.data(), program.size()));
+}
+
+// What the guest printed into captured output before the register dump it
+// ends with, taking it out of output for the next run.
+inline std::string printed(std::string& output)
+{
+    std::string text = output.substr(0, output.find("$zero"));
+    output.clear();
+    return text;
+}
+
+} // namespace guest
+
+#endif //MIPS_TESTS_GUEST_H
@@ -0,0 +1,80 @@
+#include <gtest/gtest.h>
+
+#include "Guest.h"
+
+using namespace guest;
+
+namespace {
+
+std::unique_ptr<VM> run(const std::vector<uint32_t>& text, Dispatch dispatch)
+{
+    std::unique_ptr<VM> vm = load(text);
+    std::string output;
+    vm->io.capture(&output);
+    vm->dispatch = dispatch;
+    EXPECT_EQ(vm->execute(), 0);
+    return vm;
+}
+
+uint32_t word(const VM& vm, Register r)
+{
+    return vm.registers[r].word;
+}
+
+// Runs op on $t0 and $t1 and moves HI to $s0 and LO to $s1.
+std::vector<uint32_t> hi_lo(Funct op, std::vector<uint32_t> operands)
+{
+    operands.push_back(r_type(op, Register::T0, Register::T1, Register::ZERO));
+    operands.push_back(r_type(Funct::MFHI, Register::ZERO, Register::ZERO, Register::S0));
+    operands.push_back(r_type(Funct::MFLO, Register::ZERO, Register::ZERO, Register::S1));
+    return operands;
+}
+
+const Dispatch engines[] = {Dispatch::Switch, Dispatch::Threaded, Dispatch::Jit};
+
+} // namespace
+
+TEST(Multiply, SplitsProductIntoHiAndLo)
+{
+    for (Dispatch dispatch : engines) {
+        std::unique_ptr<VM> vm = run(hi_lo(Funct::MULT, {li(Register::T0, -3), li(Register::T1, 5)}), dispatch);
+        EXPECT_EQ(word(*vm, Register::S0), 0xFFFFFFFFu);
+        EXPECT_EQ(word(*vm, Register::S1), 0xFFFFFFF1u);
+
+        vm = run(hi_lo(Funct::MULTU, {li(Register::T0, -3), li(Register::T1, 2)}), dispatch);
+        EXPECT_EQ(word(*vm, Register::S0), 1u);
+        EXPECT_EQ(word(*vm, Register::S1), 0xFFFFFFFAu);
+    }
+}
+
+TEST(Divide, QuotientAndRemainder)
+{
+    for (Dispatch dispatch : engines) {
+        std::unique_ptr<VM> vm = run(hi_lo(Funct::DIV, {li(Register::T0, -7), li(Register::T1, 2)}), dispatch);
+        EXPECT_EQ(word(*vm, Register::S0), 0xFFFFFFFFu);
+        EXPECT_EQ(word(*vm, Register::S1), 0xFFFFFFFDu);
+
+        vm = run(hi_lo(Funct::DIVU, {li(Register::T0, -7), li(Register::T1, 2)}), dispatch);
+        EXPECT_EQ(word(*vm, Register::S0), 1u);
+        EXPECT_EQ(word(*vm, Register::S1), 0x7FFFFFFCu);
+    }
+}
+
+// Neither traps: the host would take the whole process down with the guest.
+TEST(Divide, ByZeroAndOverflow)
+{
+    for (Dispatch dispatch : engines) {
+        for (Funct op : {Funct::DIV, Funct::DIVU}) {
+            std::unique_ptr<VM> vm = run(hi_lo(op, {li(Register::T0, 7), li(Register::T1, 0)}), dispatch);
+            EXPECT_EQ(word(*vm, Register::S0), 7u);
+            EXPECT_EQ(word(*vm, Register::S1), 0u);
+        }
+
+        std::unique_ptr<VM> vm = run(hi_lo(Funct::DIV, {
+            i_type(Opcode::LUI, Register::ZERO, Register::T0, 0x8000),
+            li(Register::T1, -1),
+        }), dispatch);
+        EXPECT_EQ(word(*vm, Register::S0), 0u);
+        EXPECT_EQ(word(*vm, Register::S1), 0x80000000u);
+    }
+}
@@ -0,0 +1,135 @@
+#include <gtest/gtest.h>
+
+#include "Guest.h"
+
+using namespace guest;
+
+namespace {
+
+// Sums 0..99999 with the sequences the assembler emits: li as lui/ori, and a
+// loop increment feeding slt and the back edge.
+const std::vector<uint32_t> sum_loop = {
+    i_type(Opcode::LUI, Register::ZERO, Register::T2, 1),
+    i_type(Opcode::ORI, Register::T2, Register::T2, 0x86A0),
+    li(Register::T0, 0),
+    li(Register::T1, 0),
+    r_type(Funct::ADDU, Register::T1, Register::T0, Register::T1),
+    i_type(Opcode::ADDIU, Register::T0, Register::T0, 1),
+    r_type(Funct::SLT, Register::T0, Register::T2, Register::T3),
+    i_type(Opcode::BNE, Register::T3, Register::ZERO, -4),
+    li(Register::T4, 1),
+};
+
+// Stores a bne over the word after a decrement, turning straight-line code
+// into a loop that counts $t0 down to zero.
+const std::vector<uint32_t> patched_loop = {
+    i_type(Opcode::LUI, Register::ZERO, Register::T1, 0x1500),
+    i_type(Opcode::ORI, Register::T1, Register::T1, 0xFFFE),
+    i_type(Opcode::SW, Register::ZERO, Register::T1, 5 * 4),
+    li(Register::T0, 3),
+    i_type(Opcode::ADDIU, Register::T0, Register::T0, -1),
+    0,
+    li(Register::T2, 7),
+};
+
+std::unique_ptr<VM> run(const std::vector<uint32_t>& text, Dispatch dispatch, bool fuse)
+{
+    std::unique_ptr<VM> vm = load(text);
+    std::string output;
+    vm->io.capture(&output);
+    vm->dispatch = dispatch;
+    if (!fuse) {
+        vm->fuse = false;
+        vm->decode_text();
+    }
+    EXPECT_EQ(vm->execute(), 0);
+    return vm;
+}
+
+void expect_same_registers(const VM& a, const VM& b)
+{
+    for (size_t n = 0; n < 32; ++n)
+        EXPECT_EQ(a.registers[n].word, b.registers[n].word) << "register " << n;
+    EXPECT_EQ(a.hi, b.hi);
+    EXPECT_EQ(a.lo, b.lo);
+}
+
+} // namespace
+
+TEST(Fusion, FusesAssemblerSequences)
+{
+    std::unique_ptr<VM> vm = load(sum_loop);
+    EXPECT_EQ(vm->text[0].op, Operation::LUI_ORI);
+    EXPECT_EQ(vm->text[5].op, Operation::ADDIU_SLT_BNE);
+    EXPECT_EQ(vm->text[6].op, Operation::SLT_BNE);
+    EXPECT_EQ(vm->text[7].op, Operation::BNE);
+
+    vm->fuse = false;
+    vm->decode_text();
+    EXPECT_EQ(vm->text[0].op, Operation::LUI);
+    EXPECT_EQ(vm->text[5].op, Operation::ADDIU);
+    EXPECT_EQ(vm->text[6].op, Operation::SLT);
+}
+
+TEST(Fusion, SameResultsAsUnfused)
+{
+    for (Dispatch dispatch : {Dispatch::Switch, Dispatch::Threaded, Dispatch::Jit}) {
+        std::unique_ptr<VM> fused = run(sum_loop, dispatch, true);
+        std::unique_ptr<VM> plain = run(sum_loop, dispatch, false);
+        EXPECT_EQ(fused->registers[Register::T1].word, 4999950000u & 0xFFFFFFFFu);
+        expect_same_registers(*fused, *plain);
+    }
+}
+
+TEST(Fusion, PatchRefusesEarlierWords)
+{
+    std::unique_ptr<VM> vm = load(patched_loop);
+    EXPECT_EQ(vm->text[4].op, Operation::ADDIU);
+
+    vm->memory[5] = i_type(Opcode::BNE, Register::T0, Register::ZERO, -2);
+    vm->patch_text(5);
+    EXPECT_EQ(vm->text[4].op, Operation::ADDIU_BNE);
+    EXPECT_EQ(vm->text[5].op, Operation::BNE);
+
+    vm->memory[5] = 0;
+    vm->patch_text(5);
+    EXPECT_EQ(vm->text[4].op, Operation::ADDIU);
+    EXPECT_EQ(vm->text[5].op, Operation::SLL);
+}
+
+TEST(Fusion, SelfModifiedCodeRunsTheSame)
+{
+    for (Dispatch dispatch : {Dispatch::Switch, Dispatch::Threaded, Dispatch::Jit}) {
+        std::unique_ptr<VM> fused = run(patched_loop, dispatch, true);
+        std::unique_ptr<VM> plain = run(patched_loop, dispatch, false);
+        EXPECT_EQ(fused->registers[Register::T0].word, 0u);
+        EXPECT_EQ(fused->registers[Register::T2].word, 7u);
+        EXPECT_EQ(fused->text[4].op, Operation::ADDIU_BNE);
+        expect_same_registers(*fused, *plain);
+    }
+}
+
+TEST(Fusion, ForkKeepsDecodedText)
+{
+    std::unique_ptr<VM> vm = load(patched_loop);
+    std::string output;
+    vm->io.capture(&output);
+    std::unique_ptr<VM> child = vm->fork();
+    EXPECT_EQ(child->text[4].op, Operation::ADDIU);
+    EXPECT_EQ(child->text[5].op, Operation::SLL);
+
+    // The run patches the parent's text, so the next fork needs a new image.
+    EXPECT_EQ(vm->execute(), 0);
+    child = vm->fork();
+    EXPECT_EQ(child->text[4].op, Operation::ADDIU_BNE);
+    EXPECT_EQ(child->text[5].op, Operation::BNE);
+    EXPECT_EQ(child->block_length, vm->block_length);
+    EXPECT_EQ(child->registers[Register::T2].word, 7u);
+
+    vm->fuse = false;
+    vm->decode_text();
+    child = vm->fork();
+    EXPECT_FALSE(child->fuse);
+    EXPECT_EQ(child->text[0].op, Operation::LUI);
+    EXPECT_EQ(child->text[5].op, Operation::BNE);
+}
@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+
+#include "Guest.h"
+
+using namespace guest;
+
+namespace {
+
+const uint32_t counter = 0x1000;
+const uint32_t worker = 25;
+
+// Spawns four harts that each add 10000 to the counter with LL/SC, passing
+// them 4 down to 1 to exit with. Then joins harts 1 to 4, summing their
+// statuses into $s3, joins a hart that doesn't exist into $s4 and loads the
+// counter into $s5.
+const std::vector<uint32_t> contention = {
+    li(Register::S1, 4),
+    li(Register::S2, 0),
+    li(Register::A0, worker * 4),
+    r_type(Funct::ADDU, Register::S1, Register::ZERO, Register::A1),
+    li(Register::A2, 0),
+    li(Register::V0, 60),
+    syscall(),
+    i_type(Opcode::ADDIU, Register::S1, Register::S1, -1),
+    i_type(Opcode::BNE, Register::S1, Register::ZERO, -7),
+    li(Register::S1, 1),
+    li(Register::S3, 0),
+    r_type(Funct::ADDU, Register::S1, Register::ZERO, Register::A0),
+    li(Register::V0, 61),
+    syscall(),
+    r_type(Funct::ADDU, Register::S3, Register::V0, Register::S3),
+    i_type(Opcode::ADDIU, Register::S1, Register::S1, 1),
+    i_type(Opcode::SLTI, Register::S1, Register::T0, 5),
+    i_type(Opcode::BNE, Register::T0, Register::ZERO, -7),
+    li(Register::A0, 9),
+    li(Register::V0, 61),
+    syscall(),
+    r_type(Funct::ADDU, Register::V0, Register::ZERO, Register::S4),
+    i_type(Opcode::LW, Register::ZERO, Register::S5, counter),
+    li(Register::V0, 10),
+    syscall(),
+    // worker:
+    li(Register::T1, 10000),
+    i_type(Opcode::LL, Register::ZERO, Register::T0, counter),
+    i_type(Opcode::ADDIU, Register::T0, Register::T0, 1),
+    i_type(Opcode::SC, Register::ZERO, Register::T0, counter),
+    i_type(Opcode::BEQ, Register::T0, Register::ZERO, -4),
+    i_type(Opcode::ADDIU, Register::T1, Register::T1, -1),
+    i_type(Opcode::BNE, Register::T1, Register::ZERO, -6),
+    li(Register::V0, 17),
+    syscall(),
+};
+
+// Spawns a hart that faults and one at an entry past the text, joins the
+// first into $s0 and keeps what the second spawn returned in $s1.
+const std::vector<uint32_t> failures = {
+    li(Register::A0, 13 * 4),
+    li(Register::V0, 60),
+    syscall(),
+    r_type(Funct::ADDU, Register::V0, Register::ZERO, Register::A0),
+    li(Register::V0, 61),
+    syscall(),
+    r_type(Funct::ADDU, Register::V0, Register::ZERO, Register::S0),
+    li(Register::A0, 0x4000),
+    li(Register::V0, 60),
+    syscall(),
+    r_type(Funct::ADDU, Register::V0, Register::ZERO, Register::S1),
+    li(Register::V0, 10),
+    syscall(),
+    // The hart that faults:
+    i_type(Opcode::LUI, Register::ZERO, Register::T0, 0x7000),
+    i_type(Opcode::LW, Register::T0, Register::T1, 0),
+};
+
+std::unique_ptr<VM> run(const std::vector<uint32_t>& text, Dispatch dispatch, std::string& output)
+{
+    std::unique_ptr<VM> vm = load(text, {}, 2048);
+    vm->io.capture(&output);
+    vm->dispatch = dispatch;
+    EXPECT_EQ(vm->execute(), 0);
+    return vm;
+}
+
+const Dispatch engines[] = {Dispatch::Switch, Dispatch::Threaded, Dispatch::Jit};
+
+} // namespace
+
+TEST(Harts, LoadLinkedStoreConditionalUnderContention)
+{
+    for (Dispatch dispatch : engines) {
+        std::string output;
+        std::unique_ptr<VM> vm = run(contention, dispatch, output);
+        EXPECT_EQ(vm->registers[Register::S5].word, 40000u);
+        EXPECT_EQ(vm->registers[Register::S3].word, 10u);
+        EXPECT_EQ(vm->registers[Register::S4].word, 0xFFFFFFFFu);
+    }
+}
+
+TEST(Harts, FailedHartsJoinAsMinusOne)
+{
+    for (Dispatch dispatch : engines) {
+        std::string output;
+        std::unique_ptr<VM> vm = run(failures, dispatch, output);
+        EXPECT_EQ(vm->registers[Register::S0].word, 0xFFFFFFFFu);
+        EXPECT_EQ(vm->registers[Register::S1].word, 0xFFFFFFFFu);
+    }
+}
+
+TEST(Harts, MisalignedAtomicsFault)
+{
+    for (Opcode opcode : {Opcode::LL, Opcode::SC}) {
+        for (Dispatch dispatch : engines) {
+            std::unique_ptr<VM> vm = load({i_type(opcode, Register::ZERO, Register::T0, counter + 2)}, {}, 2048);
+            vm->dispatch = dispatch;
+            try {
+                vm->execute();
+                ADD_FAILURE() << "no fault";
+            } catch (const MemoryFault& fault) {
+                EXPECT_EQ(fault.address, counter + 2);
+            }
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#include <gtest/gtest.h>
+
+#include "Guest.h"
+
+using namespace guest;
+
+namespace {
+
+const std::vector<uint32_t> wild_jump = {
+    li(Register::A0, 5),
+    li(Register::V0, 1),
+    syscall(),
+    j_type(Opcode::J, 0x3FFFFFF),
+};
+
+} // namespace
+
+TEST(Jumps, OutOfBoundsStopsWithAnError)
+{
+    for (Dispatch dispatch : {Dispatch::Switch, Dispatch::Threaded, Dispatch::Jit}) {
+        std::unique_ptr<VM> vm = load(wild_jump);
+        std::string output;
+        vm->io.capture(&output);
+        vm->dispatch = dispatch;
+        EXPECT_EQ(vm->execute(), 2);
+        EXPECT_EQ(vm->error, "jump out of bounds");
+        EXPECT_EQ(output, "5");
+
+        std::string program = image(wild_jump);
+        vm->reset(program.data(), program.size());
+        EXPECT_EQ(vm->error, "");
+        EXPECT_EQ(vm->run(1000), RunState::Exited);
+        EXPECT_EQ(vm->exit_status, 2);
+        EXPECT_EQ(vm->error, "jump out of bounds");
+    }
+}
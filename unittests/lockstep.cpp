@@ -0,0 +1,68 @@
+#include <gtest/gtest.h>
+
+#include <Lockstep.h>
+
+#include "Guest.h"
+
+using namespace guest;
+
+namespace {
+
+// Divides $t0 by $t1, moving HI to $s0 and LO to $s1.
+const std::vector<uint32_t> division = {
+    r_type(Funct::DIV, Register::T0, Register::T1, Register::ZERO),
+    r_type(Funct::MFHI, Register::ZERO, Register::ZERO, Register::S0),
+    r_type(Funct::MFLO, Register::ZERO, Register::ZERO, Register::S1),
+};
+
+} // namespace
+
+TEST(Lockstep, DivisionByZeroStaysInItsLane)
+{
+    const uint32_t dividends[] = {7, 7, 0x80000000, 0xFFFFFFF9};
+    const uint32_t divisors[] = {0, 2, 0xFFFFFFFF, 2};
+    std::vector<std::string> outputs(4);
+    Lockstep lockstep;
+    for (size_t lane = 0; lane < 4; ++lane) {
+        std::unique_ptr<VM> vm = load(division);
+        vm->io.capture(&outputs[lane]);
+        vm->registers[Register::T0] = dividends[lane];
+        vm->registers[Register::T1] = divisors[lane];
+        lockstep.add(std::move(vm));
+    }
+    lockstep.run();
+
+    const uint32_t remainders[] = {7, 1, 0, 0xFFFFFFFF};
+    const uint32_t quotients[] = {0, 3, 0x80000000, 0xFFFFFFFD};
+    for (size_t lane = 0; lane < 4; ++lane) {
+        EXPECT_EQ(lockstep.status(lane), 0) << lockstep.error(lane);
+        EXPECT_EQ(lockstep.guest(lane).registers[Register::S0].word, remainders[lane]) << "lane " << lane;
+        EXPECT_EQ(lockstep.guest(lane).registers[Register::S1].word, quotients[lane]) << "lane " << lane;
+    }
+}
+
+TEST(Lockstep, OutOfBoundsJumpIsTheLanesError)
+{
+    // Lanes with $t0 set jump out of the program.
+    const std::vector<uint32_t> text = {
+        i_type(Opcode::BEQ, Register::T0, Register::ZERO, 1),
+        j_type(Opcode::J, 0x3FFFFFF),
+        li(Register::S0, 1),
+    };
+    std::vector<std::string> outputs(2);
+    Lockstep lockstep;
+    for (size_t lane = 0; lane < 2; ++lane) {
+        std::unique_ptr<VM> vm = load(text);
+        vm->io.capture(&outputs[lane]);
+        vm->registers[Register::T0] = static_cast<uint32_t>(lane);
+        lockstep.add(std::move(vm));
+    }
+    lockstep.run();
+
+    EXPECT_EQ(lockstep.status(0), 0);
+    EXPECT_EQ(lockstep.error(0), "");
+    EXPECT_EQ(lockstep.guest(0).registers[Register::S0].word, 1u);
+    EXPECT_EQ(lockstep.status(1), 2);
+    EXPECT_EQ(lockstep.error(1), "jump out of bounds");
+    EXPECT_EQ(outputs[1], "");
+}
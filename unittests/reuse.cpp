@@ -0,0 +1,88 @@
+#include <gtest/gtest.h>
+
+#include "Guest.h"
+
+using namespace guest;
+
+namespace {
+
+// Leaves a word in its data and marks in $s7, prints 42 and exits with 3.
+const std::vector<uint32_t> first = {
+    li(Register::T0, 42),
+    i_type(Opcode::SW, Register::ZERO, Register::T0, 10 * 4),
+    li(Register::S7, 9),
+    r_type(Funct::MULT, Register::T0, Register::T0, Register::ZERO),
+    li(Register::A0, 42),
+    li(Register::V0, 1),
+    syscall(),
+    li(Register::A0, 3),
+    li(Register::V0, 17),
+    syscall(),
+};
+
+// Prints the word where the first program left its own, and exits with 5.
+const std::vector<uint32_t> second = {
+    i_type(Opcode::LW, Register::ZERO, Register::A0, 10 * 4),
+    li(Register::V0, 1),
+    syscall(),
+    li(Register::A0, 5),
+    li(Register::V0, 17),
+    syscall(),
+};
+
+// Counts $t0 up for ever.
+const std::vector<uint32_t> endless = {
+    i_type(Opcode::ADDIU, Register::T0, Register::T0, 1),
+    j_type(Opcode::J, 0),
+};
+
+} // namespace
+
+TEST(Reuse, ResetStartsOver)
+{
+    std::unique_ptr<VM> vm = load(first, {0});
+    std::string output;
+    vm->io.capture(&output);
+    EXPECT_EQ(vm->execute(), 3);
+    EXPECT_EQ(printed(output), "42");
+    EXPECT_EQ(vm->memory.load<uint32_t>(10 * 4), 42u);
+
+    std::string program = image(second, {0, 0, 0, 0, 0, 0});
+    vm->reset(program.data(), program.size());
+    EXPECT_EQ(vm->program_counter, 0u);
+    EXPECT_EQ(vm->registers[Register::S7].word, 0u);
+    EXPECT_EQ(vm->hi, 0u);
+    EXPECT_EQ(vm->lo, 0u);
+    EXPECT_EQ(vm->text.size(), second.size() + 1);
+
+    // Output capture is kept, and nothing of the first guest's memory is.
+    EXPECT_EQ(vm->execute(), 5);
+    EXPECT_EQ(printed(output), "0");
+}
+
+TEST(Reuse, ResetAfterStoppingPartWay)
+{
+    std::string program = image(endless);
+    std::unique_ptr<VM> vm(new VM(program.data(), program.size()));
+    EXPECT_EQ(vm->run(1000), RunState::Yielded);
+    EXPECT_NE(vm->registers[Register::T0].word, 0u);
+
+    std::string output;
+    vm->io.capture(&output);
+    std::string next = image(first, {0});
+    vm->reset(next.data(), next.size());
+    EXPECT_EQ(vm->run(1000), RunState::Exited);
+    EXPECT_EQ(vm->exit_status, 3);
+    EXPECT_EQ(printed(output), "42");
+
+    // And back again, stopping at each syscall on the way.
+    vm->reset(program.data(), program.size());
+    EXPECT_EQ(vm->registers[Register::T0].word, 0u);
+    EXPECT_EQ(vm->run(100), RunState::Yielded);
+    vm->reset(next.data(), next.size());
+    EXPECT_EQ(vm->run(1000, true), RunState::Syscall);
+    EXPECT_EQ(vm->program_counter, 6u);
+    EXPECT_EQ(vm->run(1000, true), RunState::Syscall);
+    EXPECT_EQ(vm->run(1000, true), RunState::Exited);
+    EXPECT_EQ(printed(output), "42");
+}
@@ -0,0 +1,48 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+
+#include <Snapshot.h>
+
+#include "Guest.h"
+
+using namespace guest;
+
+namespace {
+
+// Counts $t0 up to 100000 a word of memory at a time, so the count lives in
+// the data segment, then exits with it in $s0.
+const std::vector<uint32_t> counting = {
+    i_type(Opcode::LW, Register::ZERO, Register::T0, 9 * 4),
+    i_type(Opcode::ADDIU, Register::T0, Register::T0, 1),
+    i_type(Opcode::SW, Register::ZERO, Register::T0, 9 * 4),
+    i_type(Opcode::LUI, Register::ZERO, Register::T1, 1),
+    i_type(Opcode::ORI, Register::T1, Register::T1, 0x86A0),
+    i_type(Opcode::BNE, Register::T0, Register::T1, -6),
+    r_type(Funct::ADDU, Register::T0, Register::ZERO, Register::S0),
+    li(Register::V0, 10),
+    syscall(),
+};
+
+} // namespace
+
+TEST(Snapshot, SaveOverTheSnapshotRestoredFrom)
+{
+    std::string path = testing::TempDir() + "snapshot_test.snap";
+    std::unique_ptr<VM> vm = load(counting, {0});
+    EXPECT_EQ(vm->run(10000), RunState::Yielded);
+    save_snapshot(*vm, path);
+
+    std::unique_ptr<VM> restored = load_snapshot(path);
+    EXPECT_EQ(restored->run(10000), RunState::Yielded);
+    save_snapshot(*restored, path);
+
+    std::unique_ptr<VM> again = load_snapshot(path);
+    std::string output;
+    for (VM* guest : {restored.get(), again.get()}) {
+        guest->io.capture(&output);
+        EXPECT_EQ(guest->execute(), 0);
+        EXPECT_EQ(guest->registers[Register::S0].word, 100000u);
+    }
+    std::remove(path.c_str());
+}
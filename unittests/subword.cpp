@@ -0,0 +1,127 @@
+#include <gtest/gtest.h>
+
+#include "Guest.h"
+
+using namespace guest;
+
+namespace {
+
+// Data words the loads read: bytes 11 22 33 44 55 66 77 88 7f ff 81 82 from
+// the start of the data segment, which $s0 points at. The stores go to the
+// zeroed words after them.
+const std::vector<uint32_t> data = {0x44332211, 0x88776655, 0x8281FF7F, 0, 0, 0, 0};
+
+std::vector<uint32_t> program(std::vector<uint32_t> body)
+{
+    body.insert(body.begin(), 0);
+    body[0] = li(Register::S0, static_cast<int16_t>(body.size() * 4));
+    return body;
+}
+
+std::unique_ptr<VM> run(const std::vector<uint32_t>& text, Dispatch dispatch)
+{
+    std::unique_ptr<VM> vm = load(text, data);
+    std::string output;
+    vm->io.capture(&output);
+    vm->dispatch = dispatch;
+    EXPECT_EQ(vm->execute(), 0);
+    return vm;
+}
+
+uint32_t word(const VM& vm, Register r)
+{
+    return vm.registers[r].word;
+}
+
+const Dispatch engines[] = {Dispatch::Switch, Dispatch::Threaded, Dispatch::Jit};
+
+} // namespace
+
+TEST(Subword, ByteLoads)
+{
+    std::vector<uint32_t> text = program({
+        i_type(Opcode::LB, Register::S0, Register::T0, 8),
+        i_type(Opcode::LB, Register::S0, Register::T1, 9),
+        i_type(Opcode::LB, Register::S0, Register::T2, 11),
+        i_type(Opcode::LBU, Register::S0, Register::T3, 9),
+        i_type(Opcode::LBU, Register::S0, Register::T4, 3),
+    });
+    for (Dispatch dispatch : engines) {
+        std::unique_ptr<VM> vm = run(text, dispatch);
+        EXPECT_EQ(word(*vm, Register::T0), 0x7Fu);
+        EXPECT_EQ(word(*vm, Register::T1), 0xFFFFFFFFu);
+        EXPECT_EQ(word(*vm, Register::T2), 0xFFFFFF82u);
+        EXPECT_EQ(word(*vm, Register::T3), 0xFFu);
+        EXPECT_EQ(word(*vm, Register::T4), 0x44u);
+    }
+}
+
+TEST(Subword, HalfwordLoads)
+{
+    std::vector<uint32_t> text = program({
+        i_type(Opcode::LH, Register::S0, Register::T0, 8),
+        i_type(Opcode::LH, Register::S0, Register::T1, 10),
+        i_type(Opcode::LHU, Register::S0, Register::T2, 10),
+        // The low address bit is ignored.
+        i_type(Opcode::LHU, Register::S0, Register::T3, 1),
+    });
+    for (Dispatch dispatch : engines) {
+        std::unique_ptr<VM> vm = run(text, dispatch);
+        EXPECT_EQ(word(*vm, Register::T0), 0xFFFFFF7Fu);
+        EXPECT_EQ(word(*vm, Register::T1), 0xFFFF8281u);
+        EXPECT_EQ(word(*vm, Register::T2), 0x8281u);
+        EXPECT_EQ(word(*vm, Register::T3), 0x2211u);
+    }
+}
+
+TEST(Subword, UnalignedWordLoads)
+{
+    std::vector<uint32_t> text = program({
+        // The word at offset 1, and at offset 3, the way the assembler's
+        // ulw puts them together.
+        i_type(Opcode::LWR, Register::S0, Register::T0, 1),
+        i_type(Opcode::LWL, Register::S0, Register::T0, 4),
+        i_type(Opcode::LWR, Register::S0, Register::T1, 3),
+        i_type(Opcode::LWL, Register::S0, Register::T1, 6),
+        // Each on its own only replaces its own bytes.
+        i_type(Opcode::LUI, Register::ZERO, Register::T2, 0xAAAA),
+        i_type(Opcode::ORI, Register::T2, Register::T2, 0xAAAA),
+        i_type(Opcode::LWL, Register::S0, Register::T2, 1),
+        i_type(Opcode::LUI, Register::ZERO, Register::T3, 0xAAAA),
+        i_type(Opcode::ORI, Register::T3, Register::T3, 0xAAAA),
+        i_type(Opcode::LWR, Register::S0, Register::T3, 2),
+    });
+    for (Dispatch dispatch : engines) {
+        std::unique_ptr<VM> vm = run(text, dispatch);
+        EXPECT_EQ(word(*vm, Register::T0), 0x55443322u);
+        EXPECT_EQ(word(*vm, Register::T1), 0x77665544u);
+        EXPECT_EQ(word(*vm, Register::T2), 0x2211AAAAu);
+        EXPECT_EQ(word(*vm, Register::T3), 0xAAAA4433u);
+    }
+}
+
+TEST(Subword, Stores)
+{
+    std::vector<uint32_t> text = program({
+        i_type(Opcode::LUI, Register::ZERO, Register::T0, 0xA1B2),
+        i_type(Opcode::ORI, Register::T0, Register::T0, 0xC3D4),
+        i_type(Opcode::SB, Register::S0, Register::T0, 13),
+        i_type(Opcode::SH, Register::S0, Register::T0, 18),
+        // The low address bit is ignored.
+        i_type(Opcode::SH, Register::S0, Register::T0, 21),
+        // The word at offset 25, the way the assembler's usw takes it apart.
+        i_type(Opcode::SWR, Register::S0, Register::T0, 25),
+        i_type(Opcode::SWL, Register::S0, Register::T0, 28),
+    });
+    for (Dispatch dispatch : engines) {
+        std::unique_ptr<VM> vm = run(text, dispatch);
+        uint32_t base = static_cast<uint32_t>(text.size() * 4);
+        const Memory& memory = vm->memory;
+        EXPECT_EQ(memory.load<uint32_t>(base + 12), 0x0000D400u);
+        EXPECT_EQ(memory.load<uint32_t>(base + 16), 0xC3D40000u);
+        EXPECT_EQ(memory.load<uint32_t>(base + 20), 0x0000C3D4u);
+        EXPECT_EQ(memory.load<uint32_t>(base + 25), 0xA1B2C3D4u);
+        EXPECT_EQ(memory.load<uint8_t>(base + 24), 0u);
+        EXPECT_EQ(memory.load<uint8_t>(base + 29), 0u);
+    }
+}
@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+
+#include "Guest.h"
+
+using namespace guest;
+
+namespace {
+
+// Prints 7 with syscall 1 and keeps what $v0 comes back as in $s0, then has
+// syscall 1000 fill in the word at 0x100 and loads it into $s1.
+const std::vector<uint32_t> calls = {
+    li(Register::A0, 7),
+    li(Register::V0, 1),
+    syscall(),
+    r_type(Funct::ADDU, Register::V0, Register::ZERO, Register::S0),
+    li(Register::A0, 0x100),
+    li(Register::V0, 1000),
+    syscall(),
+    i_type(Opcode::LW, Register::ZERO, Register::S1, 0x100),
+};
+
+// Doubles $a0 into $v0 instead of printing it.
+void doubled(RegisterFile& registers, Memory&)
+{
+    registers[Register::V0] = registers[Register::A0].word * 2;
+}
+
+// Stores a marker at the guest address in $a0.
+void marker(RegisterFile& registers, Memory& memory)
+{
+    uint32_t address = registers[Register::A0].word;
+    if (address + 4 > memory.extent(address))
+        throw MemoryFault(address);
+    memory.store<uint32_t>(address, 0xC0FFEE);
+}
+
+std::string run(VM& vm, Dispatch dispatch)
+{
+    std::string output;
+    vm.io.capture(&output);
+    vm.dispatch = dispatch;
+    EXPECT_EQ(vm.execute(), 0);
+    return printed(output);
+}
+
+const Dispatch engines[] = {Dispatch::Switch, Dispatch::Threaded, Dispatch::Jit};
+
+} // namespace
+
+TEST(Syscalls, OverrideAndExtend)
+{
+    for (Dispatch dispatch : engines) {
+        std::unique_ptr<VM> vm = load(calls);
+        vm->register_syscall(1, doubled);
+        vm->register_syscall(1000, marker);
+        EXPECT_EQ(run(*vm, dispatch), "");
+        EXPECT_EQ(vm->registers[Register::S0].word, 14u);
+        EXPECT_EQ(vm->registers[Register::S1].word, 0xC0FFEEu);
+    }
+}
+
+TEST(Syscalls, EmptyHandlerRestoresBuiltin)
+{
+    for (Dispatch dispatch : engines) {
+        std::unique_ptr<VM> vm = load(calls);
+        vm->register_syscall(1, doubled);
+        vm->register_syscall(1000, marker);
+        vm->register_syscall(1, {});
+        vm->register_syscall(1000, {});
+        EXPECT_EQ(run(*vm, dispatch), "7");
+        EXPECT_EQ(vm->registers[Register::S0].word, 1u);
+        EXPECT_EQ(vm->registers[Register::S1].word, 0u);
+    }
+}
+
+TEST(Syscalls, KeptByForksAndResets)
+{
+    std::unique_ptr<VM> vm = load(calls);
+    vm->register_syscall(1000, marker);
+    std::unique_ptr<VM> child = vm->fork();
+    run(*child, Dispatch::Threaded);
+    EXPECT_EQ(child->registers[Register::S1].word, 0xC0FFEEu);
+
+    std::string program = image(calls);
+    vm->reset(program.data(), program.size());
+    run(*vm, Dispatch::Threaded);
+    EXPECT_EQ(vm->registers[Register::S1].word, 0xC0FFEEu);
+}
+
+TEST(Syscalls, GuestFaultsFromHandlers)
+{
+    std::unique_ptr<VM> vm = load(calls);
+    vm->register_syscall(1000, marker);
+    vm->registers[Register::A0] = 0;
+    vm->memory.store<uint32_t>(4 * 4, i_type(Opcode::LUI, Register::ZERO, Register::A0, 0x7000));
+    vm->patch_text(4);
+    std::string output;
+    vm->io.capture(&output);
+    EXPECT_THROW(vm->execute(), MemoryFault);
+}
+
+TEST(Syscalls, NumbersAreLimited)
+{
+    std::unique_ptr<VM> vm = load(calls);
+    EXPECT_THROW(vm->register_syscall(VM::syscall_limit, marker), std::out_of_range);
+    EXPECT_NO_THROW(vm->register_syscall(VM::syscall_limit - 1, marker));
+}
@@ -0,0 +1,373 @@
+#include "Batch.h"
+#include "Lockstep.h"
+#include "Scheduler.h"
+#include "Snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+uint64_t parse_count(const std::string& text, uint64_t max)
+{
+    // stoull takes signs and spaces, and wraps "-1" around to a huge count.
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos)
+        return 0;
+    try {
+        uint64_t value = std::stoull(text);
+        return value <= max ? value : 0;
+    } catch (const std::out_of_range&) {
+        return 0;
+    }
+}
+
+bool RunOptions::parse(const std::string& arg)
+{
+    if (arg == "--dispatch=switch")
+        dispatch = Dispatch::Switch;
+    else if (arg == "--dispatch=threaded")
+        dispatch = Dispatch::Threaded;
+    else if (arg == "--dispatch=jit")
+        dispatch = Dispatch::Jit;
+    else if (arg.compare(0, 16, "--jit-threshold=") == 0) {
+        uint64_t threshold = parse_count(arg.substr(16), UINT32_MAX);
+        if (!threshold)
+            return false;
+        jit_threshold = static_cast<uint32_t>(threshold);
+    } else if (arg == "--no-fuse")
+        fuse = false;
+    else
+        return false;
+    return true;
+}
+
+void RunOptions::apply(VM& vm) const
+{
+    vm.dispatch = dispatch;
+    vm.jit_threshold = jit_threshold;
+    if (!fuse) {
+        vm.fuse = false;
+        vm.decode_text();
+    }
+}
+
+namespace {
+
+std::unique_ptr<VM> load(const std::string& path)
+{
+    if (access(path.c_str(), R_OK) != 0)
+        throw std::runtime_error("Couldn't open " + path + "\n");
+    if (is_snapshot(path))
+        return load_snapshot(path);
+    return std::unique_ptr<VM>(new VM(path));
+}
+
+// Per-thread job queues. The owner takes jobs from the back of its own queue
+// and thieves take them from the front, so they rarely meet on the same end.
+class WorkQueues {
+public:
+    WorkQueues(size_t jobs, unsigned threads)
+            : queues(threads)
+    {
+        // Deal jobs round-robin so every thread starts out with a share of
+        // the whole manifest rather than one end of it.
+        for (size_t job = jobs; job-- > 0;)
+            queues[job % threads].jobs.push_back(job);
+    }
+
+    bool take(unsigned self, size_t& job)
+    {
+        if (pop_back(queues[self], job))
+            return true;
+        for (size_t i = 1; i < queues.size(); ++i)
+            if (pop_front(queues[(self + i) % queues.size()], job))
+                return true;
+        return false;
+    }
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    };
+
+    std::vector<Queue> queues;
+
+    static bool pop_back(Queue& queue, size_t& job)
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.jobs.empty())
+            return false;
+        job = queue.jobs.back();
+        queue.jobs.pop_back();
+        return true;
+    }
+
+    static bool pop_front(Queue& queue, size_t& job)
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.jobs.empty())
+            return false;
+        job = queue.jobs.front();
+        queue.jobs.pop_front();
+        return true;
+    }
+};
+
+} // namespace
+
+Batch::Batch(std::istream& manifest, const RunOptions& defaults)
+{
+    size_t number = 0;
+    for (std::string line; std::getline(manifest, line);) {
+        ++number;
+        std::istringstream fields(line);
+        std::string field;
+        if (!(fields >> field) || field[0] == '#')
+            continue;
+
+        BatchJob job;
+        job.program = field;
+        job.options = defaults;
+        while (fields >> field) {
+            if (field[0] == '<') {
+                job.input = field.substr(1);
+                if (job.input.empty())
+                    fields >> job.input;
+            } else if (!job.options.parse(field)) {
+                throw std::runtime_error("Unknown option " + field + " on manifest line "
+                                         + std::to_string(number) + "\n");
+            }
+        }
+        if (!prototypes.count(job.program)) {
+            std::unique_ptr<VM> prototype = load(job.program);
+            prototype->prepare_fork();
+            prototypes[job.program] = std::move(prototype);
+        }
+        jobs.push_back(std::move(job));
+    }
+}
+
+BatchResult Batch::run_job(const BatchJob& job) const
+{
+    BatchResult result;
+    // Jobs without input see end of file, not the batch's own stdin.
+    int input = open(job.input.empty() ? "/dev/null" : job.input.c_str(), O_RDONLY);
+    if (input < 0) {
+        result.status = 1;
+        result.error = "Couldn't open " + job.input;
+        return result;
+    }
+
+    try {
+        std::unique_ptr<VM> vm = prototypes.at(job.program)->fork();
+        job.options.apply(*vm);
+        vm->io.set_input(input);
+        vm->io.capture(&result.output);
+        result.status = vm->execute();
+        result.error = vm->error;
+    } catch (const std::exception& e) {
+        result.status = 1;
+        result.error = error_message(e);
+    }
+
+    close(input);
+    return result;
+}
+
+void Batch::run(unsigned threads, std::ostream* report)
+{
+    if (threads == 0)
+        threads = 1;
+    outcomes.assign(jobs.size(), BatchResult{});
+    std::vector<bool> finished(jobs.size());
+    size_t reported = 0;
+    std::mutex lock;
+    WorkQueues queues(jobs.size(), threads);
+
+    auto work = [&](unsigned self) {
+        size_t job;
+        while (queues.take(self, job)) {
+            BatchResult result = run_job(jobs[job]);
+            std::lock_guard<std::mutex> guard(lock);
+            outcomes[job] = std::move(result);
+            finished[job] = true;
+            if (!report)
+                continue;
+            for (; reported < jobs.size() && finished[reported]; ++reported)
+                report_job(reported, *report);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; ++i)
+        pool.emplace_back(work, i);
+    work(0);
+    for (std::thread& thread : pool)
+        thread.join();
+    if (report)
+        report->flush();
+}
+
+void Batch::interleave(int64_t slice, std::ostream* report)
+{
+    outcomes.assign(jobs.size(), BatchResult{});
+    std::vector<int> inputs(jobs.size(), -1);
+    std::vector<size_t> ids(jobs.size(), SIZE_MAX);
+    Scheduler scheduler(slice);
+
+    for (size_t job = 0; job < jobs.size(); ++job) {
+        BatchResult& result = outcomes[job];
+        const std::string& input = jobs[job].input;
+        inputs[job] = open(input.empty() ? "/dev/null" : input.c_str(), O_RDONLY);
+        if (inputs[job] < 0) {
+            result.status = 1;
+            result.error = "Couldn't open " + input;
+            continue;
+        }
+        try {
+            std::unique_ptr<VM> vm = prototypes.at(jobs[job].program)->fork();
+            jobs[job].options.apply(*vm);
+            vm->io.set_input(inputs[job]);
+            vm->io.capture(&result.output);
+            ids[job] = scheduler.add(std::move(vm));
+        } catch (const std::exception& e) {
+            result.status = 1;
+            result.error = error_message(e);
+        }
+    }
+
+    scheduler.run();
+
+    for (size_t job = 0; job < jobs.size(); ++job) {
+        if (ids[job] != SIZE_MAX) {
+            outcomes[job].status = scheduler.status(ids[job]);
+            outcomes[job].error = scheduler.error(ids[job]);
+        }
+        if (inputs[job] >= 0)
+            close(inputs[job]);
+        if (report)
+            report_job(job, *report);
+    }
+    if (report)
+        report->flush();
+}
+
+void Batch::lockstep(size_t width, unsigned threads, std::ostream* report)
+{
+    if (width == 0)
+        width = 1;
+    if (threads == 0)
+        threads = 1;
+    outcomes.assign(jobs.size(), BatchResult{});
+
+    // Lanes of a warp have to run the same program, in manifest order.
+    std::map<std::string, std::vector<size_t>> programs;
+    for (size_t job = 0; job < jobs.size(); ++job)
+        programs[jobs[job].program].push_back(job);
+    std::vector<std::vector<size_t>> warps;
+    for (const auto& program : programs)
+        for (size_t first = 0; first < program.second.size(); first += width) {
+            size_t last = std::min(first + width, program.second.size());
+            warps.emplace_back(program.second.begin() + first, program.second.begin() + last);
+        }
+
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+        for (size_t warp; (warp = next++) < warps.size();) {
+            Lockstep lanes;
+            std::vector<int> inputs;
+            std::vector<size_t> members;
+            for (size_t job : warps[warp]) {
+                BatchResult& result = outcomes[job];
+                const std::string& input = jobs[job].input;
+                int fd = open(input.empty() ? "/dev/null" : input.c_str(), O_RDONLY);
+                if (fd < 0) {
+                    result.status = 1;
+                    result.error = "Couldn't open " + input;
+                    continue;
+                }
+                inputs.push_back(fd);
+                try {
+                    std::unique_ptr<VM> vm = prototypes.at(jobs[job].program)->fork();
+                    jobs[job].options.apply(*vm);
+                    vm->io.set_input(fd);
+                    vm->io.capture(&result.output);
+                    lanes.add(std::move(vm));
+                    members.push_back(job);
+                } catch (const std::exception& e) {
+                    result.status = 1;
+                    result.error = error_message(e);
+                }
+            }
+
+            lanes.run();
+
+            for (size_t lane = 0; lane < members.size(); ++lane) {
+                outcomes[members[lane]].status = lanes.status(lane);
+                outcomes[members[lane]].error = lanes.error(lane);
+            }
+            for (int fd : inputs)
+                close(fd);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; ++i)
+        pool.emplace_back(work);
+    work();
+    for (std::thread& thread : pool)
+        thread.join();
+
+    if (!report)
+        return;
+    for (size_t job = 0; job < jobs.size(); ++job)
+        report_job(job, *report);
+    report->flush();
+}
+
+void Batch::report_job(size_t job, std::ostream& report) const
+{
+    const BatchResult& done = outcomes[job];
+    report << "=== " << job << ' ' << jobs[job].program << " exit " << done.status;
+    if (!done.error.empty())
+        report << " (" << done.error << ')';
+    report << '\n' << done.output;
+    if (!done.output.empty() && done.output.back() != '\n')
+        report << '\n';
+}
+
+void Batch::benchmark(unsigned max_threads, std::ostream& report)
+{
+    double baseline = 0;
+    report << "threads   jobs/s   speedup\n";
+    for (unsigned threads = 1;; threads = std::min(threads * 2, max_threads)) {
+        auto start = std::chrono::steady_clock::now();
+        run(threads, nullptr);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double rate = jobs.size() / elapsed.count();
+        if (threads == 1)
+            baseline = rate;
+        report << std::setw(7) << threads << std::fixed << std::setprecision(1)
+               << std::setw(9) << rate << std::setw(9) << std::setprecision(2)
+               << rate / baseline << "x\n";
+        if (threads >= max_threads)
+            break;
+    }
+}
+
+int Batch::status() const
+{
+    for (const BatchResult& result : outcomes)
+        if (result.status != 0)
+            return result.status;
+    return 0;
+}
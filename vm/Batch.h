@@ -0,0 +1,90 @@
+#ifndef MIPS_BATCH_H
+#define MIPS_BATCH_H
+
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "VM.h"
+
+// The execution options main() accepts, for one VM.
+struct RunOptions {
+    Dispatch dispatch{Dispatch::Threaded};
+    bool fuse{true};
+    uint32_t jit_threshold{1000};
+
+    // Takes arg if it is one of ours.
+    bool parse(const std::string& arg);
+
+    void apply(VM& vm) const;
+};
+
+// Parses the positive decimal number of an option like --jobs=N, or returns
+// 0 if text isn't one or is more than max.
+uint64_t parse_count(const std::string& text, uint64_t max);
+
+struct BatchJob {
+    std::string program;
+    std::string input;  // file for the guest's stdin, none when empty
+    RunOptions options;
+};
+
+struct BatchResult {
+    int status{0};
+    std::string output;
+    std::string error;  // why the job didn't run to completion
+};
+
+// Runs many guest programs in one process.
+//
+// The manifest has a job per line: the executable, optionally "< file" for
+// its input, then any options to run it with, which override the defaults.
+// Blank lines and lines starting with '#' are skipped:
+//
+//     sort.out < numbers.txt --dispatch=jit
+//
+// Every executable, or snapshot, is loaded once into a prototype VM however
+// many jobs run it, and each job gets a copy-on-write fork of the prototype.
+// Jobs are dealt out to per-thread queues; a thread that runs out of work
+// steals from the others. Output is captured per job and reported in manifest
+// order as soon as every job before it has finished, so the report doesn't
+// depend on the thread count.
+class Batch {
+public:
+    Batch(std::istream& manifest, const RunOptions& defaults);
+
+    // Runs every job on the given number of threads, writing the report to
+    // report if there is one.
+    void run(unsigned threads, std::ostream* report);
+
+    // Runs every job on the calling thread instead, interleaved by a
+    // Scheduler in slices of the given number of instructions.
+    void interleave(int64_t slice, std::ostream* report);
+
+    // Runs the jobs of each program in Lockstep warps of up to width lanes,
+    // with warps spread over the given number of threads. The report comes
+    // out once every job has finished. Narrow warps are slower than run(),
+    // which is why main() leaves this out; see Lockstep for where it pays off.
+    void lockstep(size_t width, unsigned threads, std::ostream* report);
+
+    // Runs the whole batch at 1, 2, 4... up to max_threads threads and
+    // reports the throughput at each.
+    void benchmark(unsigned max_threads, std::ostream& report);
+
+    const std::vector<BatchResult>& results() const { return outcomes; }
+
+    // Exit status for the process: the first nonzero job status, if any.
+    int status() const;
+
+private:
+    std::vector<BatchJob> jobs;
+    std::map<std::string, std::unique_ptr<VM>> prototypes;
+    std::vector<BatchResult> outcomes;
+
+    BatchResult run_job(const BatchJob& job) const;
+    void report_job(size_t job, std::ostream& report) const;
+};
+
+#endif //MIPS_BATCH_H
@@ -0,0 +1,225 @@
+#include "Cache.h"
+#include "VM.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+const char* const region_names[] = {"text", "data", "heap", "stack"};
+
+bool is_power_of_two(uint32_t value)
+{
+    return value && !(value & (value - 1));
+}
+
+bool is_memory(Operation op)
+{
+    return op >= Operation::LB && op <= Operation::SC;
+}
+
+uint32_t parse_size(const std::string& text)
+{
+    size_t end;
+    unsigned long value = std::stoul(text, &end);
+    if (end < text.size() && (text[end] == 'k' || text[end] == 'K')) {
+        value *= 1024;
+        end += 1;
+    } else if (end < text.size() && (text[end] == 'm' || text[end] == 'M')) {
+        value *= 1024 * 1024;
+        end += 1;
+    }
+    if (end != text.size())
+        throw std::invalid_argument("bad cache size " + text);
+    return static_cast<uint32_t>(value);
+}
+
+double percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * static_cast<double>(part) / static_cast<double>(whole) : 0.0;
+}
+
+void print_level(std::ostream& os, const char* name, const CacheConfig& config,
+                 uint64_t accesses, uint64_t misses)
+{
+    os << "  " << std::left << std::setw(4) << name << std::right
+       << std::setw(7) << config.size / 1024 << " KiB " << std::setw(2) << config.ways << "-way "
+       << std::setw(3) << config.line << " B lines"
+       << std::setw(14) << accesses << " accesses" << std::setw(12) << misses << " misses"
+       << std::setw(8) << std::fixed << std::setprecision(2) << percent(accesses - misses, accesses)
+       << "% hits\n";
+}
+
+} // namespace
+
+Cache::Cache(const CacheConfig& config)
+        : geometry(config)
+{
+    if (!is_power_of_two(config.line) || !config.ways
+        || config.size % (config.ways * config.line) || config.size < config.ways * config.line)
+        throw std::invalid_argument("bad cache geometry");
+    sets = config.size / (config.ways * config.line);
+    line_shift = 0;
+    while ((1u << line_shift) < config.line)
+        line_shift += 1;
+    tags.resize(static_cast<size_t>(sets) * config.ways);
+    last_used.resize(tags.size());
+}
+
+bool Cache::access(uint32_t address)
+{
+    uint32_t line = address >> line_shift;
+    size_t first = static_cast<size_t>(line % sets) * geometry.ways;
+    size_t victim = first;
+    clock += 1;
+    for (size_t way = first; way < first + geometry.ways; ++way) {
+        if (last_used[way] && tags[way] == line) {
+            last_used[way] = clock;
+            return true;
+        }
+        if (last_used[way] < last_used[victim])
+            victim = way;
+    }
+    tags[victim] = line;
+    last_used[victim] = clock;
+    return false;
+}
+
+void CacheModel::Config::parse(const std::string& spec)
+{
+    std::istringstream input(spec);
+    for (std::string item; std::getline(input, item, ',');) {
+        size_t equals = item.find('=');
+        size_t first = item.find(':', equals);
+        size_t second = first == std::string::npos ? first : item.find(':', first + 1);
+        if (equals == std::string::npos || second == std::string::npos)
+            throw std::invalid_argument("bad cache level " + item);
+        std::string name = item.substr(0, equals);
+        CacheConfig level{parse_size(item.substr(equals + 1, first - equals - 1)),
+                          static_cast<uint32_t>(std::stoul(item.substr(first + 1, second - first - 1))),
+                          parse_size(item.substr(second + 1))};
+        Cache{level}; // checks the geometry
+        if (name == "l1i")
+            l1i = level;
+        else if (name == "l1d")
+            l1d = level;
+        else if (name == "l2")
+            l2 = level;
+        else
+            throw std::invalid_argument("unknown cache level " + name);
+    }
+}
+
+CacheModel::CacheModel(VM& vm, const Config& config)
+        : vm(vm), l1i(config.l1i), l1d(config.l1d), l2(config.l2),
+          data_segment(static_cast<uint32_t>(vm.memory.data_segment * sizeof(mem_t))),
+          program_break(static_cast<uint32_t>(vm.memory.program_break * sizeof(mem_t))),
+          fetches(vm.text.size()), accesses(vm.text.size()) { }
+
+void CacheModel::enter_block(uint32_t pc)
+{
+    block = pc;
+    next_access = pc;
+    uint32_t end = std::min<uint32_t>(pc + vm.block_length[pc], static_cast<uint32_t>(vm.memory.data_segment));
+    for (uint32_t n = pc; n < end; ++n) {
+        CacheCounts& counts = fetches[n];
+        counts.accesses += 1;
+        if (l1i.access(n * 4))
+            continue;
+        counts.l1_misses += 1;
+        l2_counts.accesses += 1;
+        if (!l2.access(n * 4)) {
+            counts.l2_misses += 1;
+            l2_counts.l2_misses += 1;
+        }
+    }
+}
+
+void CacheModel::data(uint32_t address)
+{
+    uint32_t end = block + vm.block_length[block];
+    while (next_access < end && !is_memory(vm.text[next_access].op))
+        next_access += 1;
+    CacheCounts unattributed;
+    CacheCounts& counts = next_access < end ? accesses[next_access++] : unattributed;
+    CacheCounts& area = regions[region(address)];
+
+    counts.accesses += 1;
+    area.accesses += 1;
+    if (l1d.access(address))
+        return;
+    counts.l1_misses += 1;
+    area.l1_misses += 1;
+    l2_counts.accesses += 1;
+    if (!l2.access(address)) {
+        counts.l2_misses += 1;
+        area.l2_misses += 1;
+        l2_counts.l2_misses += 1;
+    }
+}
+
+size_t CacheModel::region(uint32_t address) const
+{
+    if (address < data_segment)
+        return 0;
+    if (address < program_break)
+        return 1;
+    // The heap grows up from the initial break and the stack down from the
+    // top, so whatever lies between the current break and the top is stack.
+    if (address < vm.memory.program_break * sizeof(mem_t))
+        return 2;
+    return 3;
+}
+
+void CacheModel::report(std::ostream& os, size_t top) const
+{
+    uint64_t fetch_total = 0, fetch_misses = 0, data_total = 0, data_misses = 0;
+    for (const CacheCounts& counts : fetches) {
+        fetch_total += counts.accesses;
+        fetch_misses += counts.l1_misses;
+    }
+    for (const CacheCounts& counts : regions) {
+        data_total += counts.accesses;
+        data_misses += counts.l1_misses;
+    }
+
+    os << "cache:\n";
+    print_level(os, "L1I", l1i.config(), fetch_total, fetch_misses);
+    print_level(os, "L1D", l1d.config(), data_total, data_misses);
+    print_level(os, "L2", l2.config(), l2_counts.accesses, l2_counts.l2_misses);
+
+    auto print_pcs = [&](const char* title, const std::vector<CacheCounts>& counts) {
+        std::vector<uint32_t> pcs;
+        for (uint32_t pc = 0; pc < counts.size(); ++pc)
+            if (counts[pc].l1_misses)
+                pcs.push_back(pc);
+        std::sort(pcs.begin(), pcs.end(), [&counts](uint32_t a, uint32_t b) {
+            return counts[a].l1_misses != counts[b].l1_misses ? counts[a].l1_misses > counts[b].l1_misses : a < b;
+        });
+        if (pcs.size() > top)
+            pcs.resize(top);
+        os << title << "\n     address      accesses     L1 misses     L2 misses     L1 hits\n";
+        for (uint32_t pc : pcs) {
+            const CacheCounts& c = counts[pc];
+            os << "  0x" << std::hex << std::setw(8) << std::setfill('0') << pc * 4
+               << std::dec << std::setfill(' ') << std::setw(14) << c.accesses
+               << std::setw(14) << c.l1_misses << std::setw(14) << c.l2_misses
+               << std::setw(11) << std::fixed << std::setprecision(2)
+               << percent(c.accesses - c.l1_misses, c.accesses) << "%\n";
+        }
+    };
+    print_pcs("fetch misses by pc:", fetches);
+    print_pcs("data misses by pc:", accesses);
+
+    os << "data misses by region:\n      region      accesses     L1 misses     L2 misses     L1 hits\n";
+    for (size_t n = 0; n < 4; ++n) {
+        const CacheCounts& c = regions[n];
+        os << "  " << std::setw(10) << region_names[n] << std::setw(14) << c.accesses
+           << std::setw(14) << c.l1_misses << std::setw(14) << c.l2_misses
+           << std::setw(11) << std::fixed << std::setprecision(2)
+           << percent(c.accesses - c.l1_misses, c.accesses) << "%\n";
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef MIPS_CACHE_H
+#define MIPS_CACHE_H
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+struct VM;
+
+// Geometry of one cache level.
+struct CacheConfig {
+    uint32_t size;      // bytes
+    uint32_t ways;
+    uint32_t line;      // bytes, a power of two
+};
+
+// One set-associative cache level with LRU replacement. It only tracks
+// which lines are present; the data stays in guest memory.
+class Cache {
+public:
+    // Throws std::invalid_argument for a geometry that doesn't work out.
+    explicit Cache(const CacheConfig& config);
+
+    // True on a hit; a miss brings the line in.
+    bool access(uint32_t address);
+
+    const CacheConfig& config() const { return geometry; }
+
+private:
+    CacheConfig geometry;
+    uint32_t sets;
+    uint32_t line_shift;
+    uint64_t clock{0};
+    std::vector<uint32_t> tags;         // sets * ways, way-major within a set
+    std::vector<uint64_t> last_used;    // 0 for an empty way
+};
+
+// Counts for one level, or for one PC or region across the levels.
+struct CacheCounts {
+    uint64_t accesses{0};
+    uint64_t l1_misses{0};
+    uint64_t l2_misses{0};
+};
+
+// Memory hierarchy model, as a probe for the dispatch engines: split L1
+// instruction and data caches over a unified L2. Every instruction fetch
+// goes through L1I and every load and store through L1D, and their misses
+// through L2; caches allocate on write as well as on read.
+//
+// Fetches are simulated a basic block at a time on entry. Data accesses are
+// attributed to the load or store instruction that made them by pairing the
+// block's memory instructions with the addresses they report, in order.
+class CacheModel {
+public:
+    struct Config {
+        CacheConfig l1i{16 * 1024, 2, 32};
+        CacheConfig l1d{16 * 1024, 4, 32};
+        CacheConfig l2{128 * 1024, 8, 64};
+
+        // Overrides levels from a list like "l1d=8k:2:32,l2=64k:4:64", each
+        // level as size:ways:line. Throws std::invalid_argument.
+        void parse(const std::string& spec);
+    };
+
+    CacheModel(VM& vm, const Config& config);
+
+    void enter_block(uint32_t pc);
+
+    void load(uint32_t address) { data(address); }
+
+    void store(uint32_t address) { data(address); }
+
+    // Hit rates per level, then the PCs and regions of guest memory that
+    // miss the most.
+    void report(std::ostream& os, size_t top = 10) const;
+
+private:
+    VM& vm;
+    Cache l1i;
+    Cache l1d;
+    Cache l2;
+    uint32_t block{0};
+    uint32_t next_access{0};            // index to look for the block's next load or store from
+    uint32_t data_segment;              // the layout when the model was attached, in bytes
+    uint32_t program_break;
+    std::vector<CacheCounts> fetches;   // per text index
+    std::vector<CacheCounts> accesses;  // per text index
+    CacheCounts regions[4];             // text, data, heap, stack
+    CacheCounts l2_counts;
+
+    void data(uint32_t address);
+    size_t region(uint32_t address) const;
+};
+
+#endif //MIPS_CACHE_H
@@ -0,0 +1,228 @@
+#include "GuestIO.h"
+
+#include <cerrno>
+#include <cstring>
+#include <limits>
+
+#include <poll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t buffer_size = 1 << 16;
+
+bool is_space(char ch)
+{
+    return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
+
+void write_all(int fd, const char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+}
+
+} // namespace
+
+GuestIO::GuestIO(int input_fd, int output_fd)
+        : input_fd(input_fd), output_fd(output_fd), out(buffer_size), in(buffer_size) { }
+
+GuestIO::~GuestIO()
+{
+    flush();
+}
+
+void GuestIO::write(const char* data, size_t size)
+{
+    if (size <= out.size() - out_used) {
+        memcpy(out.data() + out_used, data, size);
+        out_used += size;
+        return;
+    }
+    if (output) {
+        flush();
+        output(data, size);
+        return;
+    }
+
+    iovec parts[2] = {{out.data(), out_used}, {const_cast<char*>(data), size}};
+    iovec* part = parts;
+    int count = 2;
+    while (count > 0) {
+        ssize_t written = ::writev(output_fd, part, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        auto done = static_cast<size_t>(written);
+        while (count > 0 && done >= part->iov_len) {
+            done -= part->iov_len;
+            ++part;
+            --count;
+        }
+        if (count > 0) {
+            part->iov_base = static_cast<char*>(part->iov_base) + done;
+            part->iov_len -= done;
+        }
+    }
+    out_used = 0;
+}
+
+void GuestIO::capture(std::string* sink)
+{
+    if (sink)
+        output = [sink](const char* data, size_t size) { sink->append(data, size); };
+    else
+        output = nullptr;
+}
+
+GuestIO::Writer GuestIO::sink() const
+{
+    if (output)
+        return output;
+    int fd = output_fd;
+    return [fd](const char* data, size_t size) { write_all(fd, data, size); };
+}
+
+void GuestIO::reset()
+{
+    flush();
+    in_begin = 0;
+    in_end = 0;
+    failed = false;
+}
+
+void GuestIO::write_uint(uint32_t value)
+{
+    char digits[10];
+    char* first = digits + sizeof digits;
+    do {
+        *--first = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value);
+    write(first, static_cast<size_t>(digits + sizeof digits - first));
+}
+
+bool GuestIO::write_string(const uint8_t* str, size_t limit)
+{
+    auto end = static_cast<const uint8_t*>(memchr(str, 0, limit));
+    write(reinterpret_cast<const char*>(str), end ? static_cast<size_t>(end - str) : limit);
+    return end != nullptr;
+}
+
+void GuestIO::flush()
+{
+    send(out.data(), out_used);
+    out_used = 0;
+}
+
+void GuestIO::send(const char* data, size_t size)
+{
+    if (output) {
+        if (size > 0)
+            output(data, size);
+        return;
+    }
+    write_all(output_fd, data, size);
+}
+
+bool GuestIO::fill()
+{
+    // Whatever the guest printed so far has to be visible before we block.
+    flush();
+    if (input_reader) {
+        in_begin = 0;
+        in_end = input_reader(in.data(), in.size());
+        return in_end > 0;
+    }
+    for (;;) {
+        ssize_t got = ::read(input_fd, in.data(), in.size());
+        if (got < 0 && errno == EINTR)
+            continue;
+        in_begin = 0;
+        in_end = got > 0 ? static_cast<size_t>(got) : 0;
+        return got > 0;
+    }
+}
+
+bool GuestIO::would_block()
+{
+    if (failed || in_begin < in_end || input_reader)
+        return false;
+    pollfd request{input_fd, POLLIN, 0};
+    return poll(&request, 1, 0) == 0;
+}
+
+bool GuestIO::skip_whitespace()
+{
+    for (;;) {
+        while (in_begin < in_end && is_space(in[in_begin]))
+            ++in_begin;
+        if (in_begin < in_end)
+            return true;
+        if (!fill())
+            return false;
+    }
+}
+
+bool GuestIO::read_uint(uint32_t& value)
+{
+    if (failed || !skip_whitespace()) {
+        failed = true;
+        return false;
+    }
+
+    bool negative = false;
+    if (in[in_begin] == '-' || in[in_begin] == '+') {
+        negative = in[in_begin] == '-';
+        if (++in_begin == in_end && !fill()) {
+            value = 0;
+            failed = true;
+            return false;
+        }
+    }
+
+    uint64_t result = 0;
+    bool digits = false;
+    bool overflow = false;
+    for (;;) {
+        while (in_begin < in_end && in[in_begin] >= '0' && in[in_begin] <= '9') {
+            result = result * 10 + static_cast<uint64_t>(in[in_begin++] - '0');
+            if (result > std::numeric_limits<uint32_t>::max()) {
+                overflow = true;
+                result = std::numeric_limits<uint32_t>::max();
+            }
+            digits = true;
+        }
+        if (in_begin < in_end || !fill())
+            break;
+    }
+
+    if (!digits || overflow) {
+        value = digits ? std::numeric_limits<uint32_t>::max() : 0;
+        failed = true;
+        return false;
+    }
+    value = static_cast<uint32_t>(negative ? 0 - result : result);
+    return true;
+}
+
+bool GuestIO::read_char(uint8_t& value)
+{
+    if (failed || !skip_whitespace()) {
+        failed = true;
+        return false;
+    }
+    value = static_cast<uint8_t>(in[in_begin++]);
+    return true;
+}
@@ -0,0 +1,105 @@
+#ifndef MIPS_GUESTIO_H
+#define MIPS_GUESTIO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Console I/O on behalf of the guest's syscalls.
+//
+// Output collects in a large buffer that goes out with a single write() when
+// it fills up, when the guest exits, or before the guest blocks on input, so
+// prompts still show up. Writes that don't fit are sent together with what is
+// buffered by one writev() instead of being copied.
+//
+// Input is read in large chunks and parsed in place. The parsers follow the
+// std::cin extractors they replace: leading whitespace is skipped, and once a
+// read fails every later read fails too.
+class GuestIO {
+public:
+    // Takes output that would have gone to the output fd.
+    using Writer = std::function<void(const char* data, size_t size)>;
+    // Supplies up to size bytes of input in place of the input fd; returns
+    // how many, 0 at end of input.
+    using Reader = std::function<size_t(char* buffer, size_t size)>;
+
+    explicit GuestIO(int input_fd = 0, int output_fd = 1);
+    ~GuestIO();
+
+    GuestIO(const GuestIO&) = delete;
+    GuestIO& operator=(const GuestIO&) = delete;
+
+    // Reads input from fd from now on. The caller keeps ownership of it.
+    void set_input(int fd) { input_fd = fd; }
+
+    int input() const { return input_fd; }
+
+    // Whether the next read would have to wait for the input fd: nothing is
+    // buffered and the fd is not readable yet. A read may still wait for the
+    // rest of a number split across writes.
+    bool would_block();
+
+    // Appends all output to sink instead of writing it to the output fd.
+    void capture(std::string* sink);
+
+    // Hand output to writer and take input from reader, instead of the fds.
+    // An empty function goes back to the fd.
+    void set_writer(Writer writer) { output = std::move(writer); }
+
+    void set_reader(Reader reader) { input_reader = std::move(reader); }
+
+    // Where flushed output goes: the writer, or the output fd.
+    Writer sink() const;
+
+    // Flushes output and forgets buffered input and a failed read, for a new
+    // guest to start from.
+    void reset();
+
+    void write(const char* data, size_t size);
+
+    void write(const std::string& str) { write(str.data(), str.size()); }
+
+    void put(char ch)
+    {
+        if (out_used == out.size())
+            flush();
+        out[out_used++] = ch;
+    }
+
+    void write_uint(uint32_t value);
+
+    // Writes the NUL-terminated string at str, looking no further than limit
+    // bytes for the terminator. Returns whether there was one; if not, the
+    // limit bytes are written.
+    bool write_string(const uint8_t* str, size_t limit);
+
+    // Extract an unsigned decimal, as std::cin >> uint32_t: a leading '-'
+    // negates modulo 2^32, no digits gives 0 and fails, overflow saturates.
+    bool read_uint(uint32_t& value);
+
+    // Extract the next non-whitespace character, as std::cin >> char. value
+    // is left alone at end of input.
+    bool read_char(uint8_t& value);
+
+    void flush();
+
+private:
+    int input_fd;
+    int output_fd;
+    Writer output;
+    Reader input_reader;
+    bool failed{false};
+    size_t out_used{0};
+    size_t in_begin{0};
+    size_t in_end{0};
+    std::vector<char> out;
+    std::vector<char> in;
+
+    void send(const char* data, size_t size);
+    bool fill();
+    bool skip_whitespace();
+};
+
+#endif //MIPS_GUESTIO_H
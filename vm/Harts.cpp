@@ -0,0 +1,97 @@
+#include "Harts.h"
+#include "VM.h"
+
+#include <iostream>
+
+Harts::Harts(VM& main)
+        : main(main), output(main.io.sink())
+{
+    main.io.flush();
+    main.io.set_writer([this](const char* data, size_t size) { write(data, size); });
+}
+
+Harts::~Harts()
+{
+    join_all();
+    main.io.flush();
+    main.io.set_writer(output);
+}
+
+uint32_t Harts::spawn(VM& parent, uint32_t entry, uint32_t argument, uint32_t stack)
+{
+    std::unique_ptr<VM> vm(new VM(main.memory.share(), parent));
+    vm->dispatch = main.dispatch;
+    vm->jit_threshold = main.jit_threshold;
+    vm->syscalls = main.syscalls;
+    vm->native_syscalls = main.native_syscalls;
+    vm->io.set_writer([this](const char* data, size_t size) { write(data, size); });
+    vm->harts = this;
+
+    vm->registers = parent.registers;
+    vm->registers[Register::A0] = argument;
+    vm->registers[Register::SP] = stack;
+    vm->registers[Register::RA] = static_cast<uint32_t>(vm->text.size() - 1);
+    vm->program_counter = entry;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto id = static_cast<uint32_t>(harts.size() + 1);
+    vm->hart = id;
+    harts.emplace_back(new Hart());
+    Hart& hart = *harts.back();
+    hart.vm = std::move(vm);
+    hart.thread = std::thread(&Harts::run, this, std::ref(hart));
+    return id;
+}
+
+int Harts::join(uint32_t id)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (id == 0 || id > harts.size())
+        return -1;
+    Hart& hart = *harts[id - 1];
+    finished.wait(lock, [&hart] { return hart.done; });
+    return hart.status;
+}
+
+void Harts::join_all()
+{
+    for (size_t n = 0;; ++n) {
+        std::thread thread;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (n == harts.size())
+                break;
+            thread = std::move(harts[n]->thread);
+        }
+        if (thread.joinable())
+            thread.join();
+    }
+}
+
+void Harts::run(Hart& hart)
+{
+    int status;
+    try {
+        status = hart.vm->execute();
+        if (!hart.vm->error.empty()) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "hart " << hart.vm->hart << ": " << hart.vm->error << '\n';
+        }
+    } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << "hart " << hart.vm->hart << ": " << error_message(e) << '\n';
+        status = -1;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        hart.done = true;
+        hart.status = status;
+    }
+    finished.notify_all();
+}
+
+void Harts::write(const char* data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(output_mutex);
+    output(data, size);
+}
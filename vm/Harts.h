@@ -0,0 +1,70 @@
+#ifndef MIPS_HARTS_H
+#define MIPS_HARTS_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "GuestIO.h"
+
+struct VM;
+
+// The hardware threads a guest spawns besides the one it started on.
+//
+// The VM that loaded the program is hart 0 and owns guest memory. Every hart
+// spawned after it is a VM of its own over a share() of that memory, with its
+// own registers, decoded text and JIT, running on a host thread of its own.
+// Plain loads and stores are as unordered between harts as the host makes
+// them; LL/SC and SYNC are how guests synchronize. A hart starts with a copy
+// of its parent's decoded text, but a store into the text segment is only
+// decoded again by the hart that made it: harts already running go on
+// executing what they had, so code has to be patched before spawning the
+// harts meant to run it. Output from every hart
+// goes out through hart 0's, a flushed buffer at a time, while harts read
+// the input fd each on their own.
+class Harts {
+public:
+    // Takes over main's output for all harts to share.
+    explicit Harts(VM& main);
+    // Waits for every hart and gives main its output back.
+    ~Harts();
+
+    Harts(const Harts&) = delete;
+    Harts& operator=(const Harts&) = delete;
+
+    // Starts a hart at text index entry with the registers of parent, except
+    // for argument in $a0 and stack in $sp. $ra points past the text, so
+    // returning from entry ends the hart with status 0. Returns its id.
+    uint32_t spawn(VM& parent, uint32_t entry, uint32_t argument, uint32_t stack);
+
+    // Waits for hart id to finish and returns its exit status: -1 when it
+    // died of a fault, or when no spawned hart has that id.
+    int join(uint32_t id);
+
+    // Waits for every hart, including those spawned meanwhile.
+    void join_all();
+
+private:
+    struct Hart {
+        std::unique_ptr<VM> vm;
+        std::thread thread;
+        bool done{false};
+        int status{0};
+    };
+
+    VM& main;
+    GuestIO::Writer output;     // main's before sharing it
+    std::mutex output_mutex;
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::vector<std::unique_ptr<Hart>> harts;   // hart n at n - 1
+
+    void run(Hart& hart);
+    void write(const char* data, size_t size);
+};
+
+#endif //MIPS_HARTS_H
@@ -0,0 +1,420 @@
+#include "Jit.h"
+#include "VM.h"
+
+#include <sys/mman.h>
+
+namespace {
+
+constexpr size_t code_capacity = 16 << 20;
+constexpr size_t max_block_length = 256;
+// Upper bound on the bytes emitted for one instruction, including an exit.
+constexpr size_t max_instruction_size = 96;
+
+// Called from compiled code when a store lands in the text segment.
+void patch_from_jit(VM* vm, uint32_t index)
+{
+    vm->patch_text(index);
+}
+
+// Just enough of an x86-64 encoder for the templates below. The compiled
+// block keeps the register file in rbx, memory in r12, hi in r13, lo in r14
+// and the VM in r15; eax and ecx are scratch.
+class Emitter {
+public:
+    explicit Emitter(uint8_t* out)
+            : start(out), cursor(out) { }
+
+    size_t size() const { return cursor - start; }
+
+    void bytes(std::initializer_list<uint8_t> bs)
+    {
+        for (auto b : bs)
+            *cursor++ = b;
+    }
+
+    void imm32(uint32_t value)
+    {
+        memcpy(cursor, &value, sizeof value);
+        cursor += sizeof value;
+    }
+
+    void imm64(uint64_t value)
+    {
+        memcpy(cursor, &value, sizeof value);
+        cursor += sizeof value;
+    }
+
+    static uint8_t slot(uint8_t reg) { return static_cast<uint8_t>(reg * sizeof(mem_t)); }
+
+    // mov eax/ecx, [rbx + 4 * reg]
+    void load_eax(uint8_t reg) { bytes({0x8B, 0x43, slot(reg)}); }
+    void load_ecx(uint8_t reg) { bytes({0x8B, 0x4B, slot(reg)}); }
+
+    // mov [rbx + 4 * reg], eax
+    void store_eax(uint8_t reg) { bytes({0x89, 0x43, slot(reg)}); }
+
+    // mov dword [rbx + 4 * reg], imm32
+    void store_imm(uint8_t reg, uint32_t value)
+    {
+        bytes({0xC7, 0x43, slot(reg)});
+        imm32(value);
+    }
+
+    void mov_eax(uint32_t value)
+    {
+        bytes({0xB8});
+        imm32(value);
+    }
+
+    void mov_ecx(uint32_t value)
+    {
+        bytes({0xB9});
+        imm32(value);
+    }
+
+    // <op> eax, imm32 for the short accumulator forms (add 05, and 25,
+    // or 0D, xor 35, cmp 3D)
+    void alu_eax(uint8_t opcode, uint32_t value)
+    {
+        bytes({opcode});
+        imm32(value);
+    }
+
+    // <op> eax, ecx (add 01, or 09, and 21, sub 29, xor 31, cmp 39)
+    void alu_eax_ecx(uint8_t opcode) { bytes({opcode, 0xC8}); }
+
+    // shl/shr/sar eax, imm8 and shl/shr/sar eax, cl (ext is the /r field)
+    void shift_imm(uint8_t ext, uint8_t amount) { bytes({0xC1, static_cast<uint8_t>(0xC0 | ext << 3), amount}); }
+    void shift_cl(uint8_t ext) { bytes({0xD3, static_cast<uint8_t>(0xC0 | ext << 3)}); }
+
+    // set<cc> al; movzx eax, al
+    void set_eax(uint8_t cc) { bytes({0x0F, cc, 0xC0, 0x0F, 0xB6, 0xC0}); }
+
+    // eax = (reg[rs] + imm) & mask, the byte address of a load or store with
+    // the low bits the access ignores cleared
+    void address(uint8_t rs, int32_t imm, uint32_t mask)
+    {
+        load_eax(rs);
+        alu_eax(0x05, static_cast<uint32_t>(imm));
+        if (mask != ~0u)
+            alu_eax(0x25, mask);
+    }
+
+    void prologue()
+    {
+        bytes({0x53});              // push rbx
+        bytes({0x41, 0x54});        // push r12
+        bytes({0x41, 0x55});        // push r13
+        bytes({0x41, 0x56});        // push r14
+        bytes({0x41, 0x57});        // push r15
+        bytes({0x48, 0x89, 0xFB});  // mov rbx, rdi
+        bytes({0x49, 0x89, 0xF4});  // mov r12, rsi
+        bytes({0x49, 0x89, 0xD5});  // mov r13, rdx
+        bytes({0x49, 0x89, 0xCE});  // mov r14, rcx
+        bytes({0x4D, 0x89, 0xC7});  // mov r15, r8
+    }
+
+    // Returns eax as the next pc.
+    void epilogue()
+    {
+        bytes({0x41, 0x5F});        // pop r15
+        bytes({0x41, 0x5E});        // pop r14
+        bytes({0x41, 0x5D});        // pop r13
+        bytes({0x41, 0x5C});        // pop r12
+        bytes({0x5B});              // pop rbx
+        bytes({0xC3});              // ret
+    }
+
+    // jmp/j<cc> rel32 back to an earlier point of the same block
+    void jump_back(std::initializer_list<uint8_t> opcode, const uint8_t* target)
+    {
+        bytes(opcode);
+        imm32(static_cast<uint32_t>(target - (cursor + 4)));
+    }
+
+    const uint8_t* here() const { return cursor; }
+
+    // After a store to the byte address in eax: if it landed in the text
+    // segment, patch the decoded records and end the block, which may itself
+    // be what was overwritten.
+    void text_store(uint32_t end, uint32_t next)
+    {
+        alu_eax(0x3D, end * 4);                     // cmp eax, end * 4
+        uint8_t* skip = cursor;
+        bytes({0x73, 0x00});                        // jae over the patch
+        bytes({0x89, 0xC6});                        // mov esi, eax
+        bytes({0xC1, 0xEE, 0x02});                  // shr esi, 2
+        bytes({0x4C, 0x89, 0xFF});                  // mov rdi, r15
+        bytes({0x48, 0xB8});                        // mov rax, patch_from_jit
+        imm64(reinterpret_cast<uint64_t>(&patch_from_jit));
+        bytes({0xFF, 0xD0});                        // call rax
+        exit(next);
+        skip[1] = static_cast<uint8_t>(cursor - skip - 2);
+    }
+
+    void exit(uint32_t pc)
+    {
+        mov_eax(pc);
+        epilogue();
+    }
+
+private:
+    uint8_t* start;
+    uint8_t* cursor;
+};
+
+} // namespace
+
+Jit::Jit(VM& vm, uint32_t threshold)
+        : vm(vm), threshold(threshold), counters(vm.text.size()), blocks(vm.text.size())
+{
+    if (!supported())
+        return;
+    void* mapping = mmap(nullptr, code_capacity, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping != MAP_FAILED) {
+        code = static_cast<uint8_t*>(mapping);
+        code_size = code_capacity;
+    }
+}
+
+Jit::~Jit()
+{
+    if (code)
+        munmap(code, code_size);
+}
+
+bool Jit::supported()
+{
+#if defined(__x86_64__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+JitBlock Jit::enter(uint32_t pc)
+{
+    if (stale)
+        flush();
+    if (pc >= blocks.size())
+        return nullptr;
+    if (!blocks[pc] && ++counters[pc] == threshold)
+        blocks[pc] = compile(pc);
+    return blocks[pc];
+}
+
+void Jit::flush()
+{
+    // The text may have been replaced by a program of another size.
+    blocks.assign(vm.text.size(), nullptr);
+    counters.assign(vm.text.size(), 0);
+    code_used = 0;
+    stale = false;
+}
+
+JitBlock Jit::finish(uint8_t* start, size_t size)
+{
+    code_used += size;
+    return reinterpret_cast<JitBlock>(start);
+}
+
+JitBlock Jit::compile(uint32_t entry)
+{
+    if (!code)
+        return nullptr;
+    if (code_size - code_used < max_block_length * max_instruction_size)
+        flush();
+
+    const uint32_t end = static_cast<uint32_t>(vm.memory.data_segment);
+    uint8_t* start = code + code_used;
+    Emitter emit(start);
+    emit.prologue();
+    // Branches back to the entry loop inside the block instead of returning.
+    const uint8_t* body = emit.here();
+
+    uint32_t pc = entry;
+    for (; pc < end && pc - entry < max_block_length; ++pc) {
+        // Work from the plain decoding, the records may hold superinstructions.
+        Instruction i = vm.decode(vm.memory[pc]);
+        const uint32_t next = pc + 1;
+        bool translated = true;
+
+        switch (i.op) {
+        case Operation::SLL:
+        case Operation::SRL:
+        case Operation::SRA:
+            emit.load_eax(i.rt);
+            emit.shift_imm(i.op == Operation::SLL ? 4 : i.op == Operation::SRL ? 5 : 7,
+                           static_cast<uint8_t>(i.immediate));
+            emit.store_eax(i.rd);
+            break;
+        case Operation::SLLV:
+        case Operation::SRLV:
+        case Operation::SRAV:
+            emit.load_eax(i.rs);
+            emit.load_ecx(i.rt);
+            emit.shift_cl(i.op == Operation::SLLV ? 4 : i.op == Operation::SRLV ? 5 : 7);
+            emit.store_eax(i.rd);
+            break;
+        case Operation::ADD:
+        case Operation::ADDU:
+        case Operation::SUB:
+        case Operation::SUBU:
+        case Operation::AND:
+        case Operation::OR:
+        case Operation::XOR: {
+            uint8_t opcode = 0x01;
+            if (i.op == Operation::SUB || i.op == Operation::SUBU) opcode = 0x29;
+            else if (i.op == Operation::AND) opcode = 0x21;
+            else if (i.op == Operation::OR) opcode = 0x09;
+            else if (i.op == Operation::XOR) opcode = 0x31;
+            emit.load_eax(i.rs);
+            emit.load_ecx(i.rt);
+            emit.alu_eax_ecx(opcode);
+            emit.store_eax(i.rd);
+            break;
+        }
+        case Operation::NOR:
+            // The interpreter computes !(rs | rt), keep doing the same.
+            emit.load_eax(i.rs);
+            emit.load_ecx(i.rt);
+            emit.alu_eax_ecx(0x09);
+            emit.set_eax(0x94);
+            emit.store_eax(i.rd);
+            break;
+        case Operation::SLT:
+        case Operation::SLTU:
+            emit.load_eax(i.rs);
+            emit.load_ecx(i.rt);
+            emit.alu_eax_ecx(0x39);
+            emit.set_eax(0x92);
+            emit.store_eax(i.rd);
+            break;
+        case Operation::ADDI:
+        case Operation::ADDIU:
+        case Operation::ANDI:
+        case Operation::ORI:
+        case Operation::XORI: {
+            uint8_t opcode = 0x05;
+            if (i.op == Operation::ANDI) opcode = 0x25;
+            else if (i.op == Operation::ORI) opcode = 0x0D;
+            else if (i.op == Operation::XORI) opcode = 0x35;
+            emit.load_eax(i.rs);
+            emit.alu_eax(opcode, static_cast<uint32_t>(i.immediate));
+            emit.store_eax(i.rt);
+            break;
+        }
+        case Operation::SLTI:
+        case Operation::SLTIU:
+            emit.load_eax(i.rs);
+            emit.alu_eax(0x3D, static_cast<uint32_t>(i.immediate));
+            emit.set_eax(0x92);
+            emit.store_eax(i.rt);
+            break;
+        case Operation::LUI:
+            emit.store_imm(i.rt, static_cast<uint32_t>(i.immediate));
+            break;
+        case Operation::MFHI:
+            emit.bytes({0x41, 0x8B, 0x45, 0x00});   // mov eax, [r13]
+            emit.store_eax(i.rd);
+            break;
+        case Operation::MFLO:
+            emit.bytes({0x41, 0x8B, 0x06});         // mov eax, [r14]
+            emit.store_eax(i.rd);
+            break;
+        case Operation::MTHI:
+            emit.load_eax(i.rs);
+            emit.bytes({0x41, 0x89, 0x45, 0x00});   // mov [r13], eax
+            break;
+        case Operation::MTLO:
+            emit.load_eax(i.rs);
+            emit.bytes({0x41, 0x89, 0x06});         // mov [r14], eax
+            break;
+        case Operation::LB:
+            emit.address(i.rs, i.immediate, ~0u);
+            emit.bytes({0x41, 0x0F, 0xBE, 0x04, 0x04});     // movsx eax, byte [r12 + rax]
+            emit.store_eax(i.rt);
+            break;
+        case Operation::LBU:
+            emit.address(i.rs, i.immediate, ~0u);
+            emit.bytes({0x41, 0x0F, 0xB6, 0x04, 0x04});     // movzx eax, byte [r12 + rax]
+            emit.store_eax(i.rt);
+            break;
+        case Operation::LH:
+            emit.address(i.rs, i.immediate, ~1u);
+            emit.bytes({0x41, 0x0F, 0xBF, 0x04, 0x04});     // movsx eax, word [r12 + rax]
+            emit.store_eax(i.rt);
+            break;
+        case Operation::LHU:
+            emit.address(i.rs, i.immediate, ~1u);
+            emit.bytes({0x41, 0x0F, 0xB7, 0x04, 0x04});     // movzx eax, word [r12 + rax]
+            emit.store_eax(i.rt);
+            break;
+        case Operation::LW:
+            emit.address(i.rs, i.immediate, ~3u);
+            emit.bytes({0x41, 0x8B, 0x04, 0x04});           // mov eax, [r12 + rax]
+            emit.store_eax(i.rt);
+            break;
+        case Operation::SB:
+            emit.address(i.rs, i.immediate, ~0u);
+            emit.load_ecx(i.rt);
+            emit.bytes({0x41, 0x88, 0x0C, 0x04});           // mov [r12 + rax], cl
+            emit.text_store(end, next);
+            break;
+        case Operation::SH:
+            emit.address(i.rs, i.immediate, ~1u);
+            emit.load_ecx(i.rt);
+            emit.bytes({0x66, 0x41, 0x89, 0x0C, 0x04});     // mov [r12 + rax], cx
+            emit.text_store(end, next);
+            break;
+        case Operation::SW:
+            emit.address(i.rs, i.immediate, ~3u);
+            emit.load_ecx(i.rt);
+            emit.bytes({0x41, 0x89, 0x0C, 0x04});           // mov [r12 + rax], ecx
+            emit.text_store(end, next);
+            break;
+        case Operation::J:
+            if (static_cast<uint32_t>(i.immediate) == entry)
+                emit.jump_back({0xE9}, body);
+            else
+                emit.exit(static_cast<uint32_t>(i.immediate));
+            return finish(start, emit.size());
+        case Operation::JAL:
+            emit.store_imm(31, next);
+            emit.exit(static_cast<uint32_t>(i.immediate));
+            return finish(start, emit.size());
+        case Operation::JR:
+        case Operation::JALR:
+            emit.load_eax(i.rs);
+            emit.epilogue();
+            return finish(start, emit.size());
+        case Operation::BEQ:
+        case Operation::BNE:
+            emit.load_eax(i.rs);
+            emit.bytes({0x3B, 0x43, Emitter::slot(i.rt)});  // cmp eax, [rbx + 4 * rt]
+            if (next + i.immediate == entry) {
+                // je/jne back to the top of the block
+                emit.jump_back({0x0F, static_cast<uint8_t>(i.op == Operation::BEQ ? 0x84 : 0x85)}, body);
+                emit.exit(next);
+                return finish(start, emit.size());
+            }
+            emit.mov_eax(next);
+            emit.mov_ecx(next + i.immediate);
+            // cmove/cmovne eax, ecx
+            emit.bytes({0x0F, static_cast<uint8_t>(i.op == Operation::BEQ ? 0x44 : 0x45), 0xC1});
+            emit.epilogue();
+            return finish(start, emit.size());
+        default:
+            translated = false;
+            break;
+        }
+        if (!translated)
+            break;
+    }
+
+    if (pc == entry)
+        return nullptr;
+    emit.exit(pc);
+    return finish(start, emit.size());
+}
@@ -0,0 +1,59 @@
+#ifndef MIPS_JIT_H
+#define MIPS_JIT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+union mem_t;
+struct VM;
+
+// A compiled basic block. It runs the block against the guest state and
+// returns the index of the next instruction to execute.
+using JitBlock = uint32_t (*)(mem_t* registers, uint8_t* memory, uint32_t* hi, uint32_t* lo, VM* vm);
+
+// Template JIT from the decoded text segment to x86-64. Block entries are
+// counted as the interpreter reaches them and compiled once they pass the
+// threshold. Guest registers stay in the RegisterFile: every translated
+// instruction loads its operands from it and stores its result back, so the
+// interpreter and compiled code can hand over at any block boundary.
+//
+// A block runs until the first control transfer, which it executes, or the
+// first instruction it cannot translate (syscalls, multiply and divide,
+// anything unsupported), where it returns to let the interpreter take over.
+// A branch or jump back to the block's own entry loops inside the compiled
+// code without returning.
+class Jit {
+public:
+    explicit Jit(VM& vm, uint32_t threshold = 1000);
+    ~Jit();
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    // Counts an entry into the block at pc and returns its compiled code, if
+    // there is any.
+    JitBlock enter(uint32_t pc);
+
+    // Drops all compiled code once control is back in the interpreter. Called
+    // whenever the text segment changes under us.
+    void invalidate() { stale = true; }
+
+    static bool supported();
+
+private:
+    VM& vm;
+    uint32_t threshold;
+    std::vector<uint32_t> counters;
+    std::vector<JitBlock> blocks;
+    uint8_t* code{nullptr};
+    size_t code_size{0};
+    size_t code_used{0};
+    bool stale{false};
+
+    JitBlock compile(uint32_t entry);
+    JitBlock finish(uint8_t* start, size_t size);
+    void flush();
+};
+
+#endif //MIPS_JIT_H
@@ -0,0 +1,551 @@
+#include "Lockstep.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+// Faults the way the interpreter would when an access runs outside the
+// memory it may touch.
+void check(const Memory& memory, uint32_t address, uint32_t size, Memory::Access access)
+{
+    Memory::size_type limit = memory.extent(address, access);
+    if (address >= limit)
+        throw MemoryFault(address);
+    if (address + static_cast<Memory::size_type>(size) > limit)
+        throw MemoryFault(static_cast<std::ptrdiff_t>(limit));
+}
+
+// Lanes are kept in blocks of a fixed size, padded with lanes that never
+// run, so the loops over a block have a trip count the compiler knows.
+constexpr size_t block = 8;
+
+// Sets the active lanes of a block of d to those of v. The pointers never
+// overlap, which the compiler can't see for itself and needs to know to
+// vectorize the blend.
+inline void blend(uint32_t* __restrict d, const uint32_t* __restrict active, const uint32_t* __restrict v)
+{
+    for (size_t l = 0; l < block; ++l) {
+        uint32_t mask = 0u - active[l];
+        d[l] = (v[l] & mask) | (d[l] & ~mask);
+    }
+}
+
+// The lowest pc of the live lanes, or UINT32_MAX when none is.
+inline uint32_t lowest(const uint32_t* __restrict pcs, const uint32_t* __restrict live, size_t width)
+{
+    uint32_t pc = UINT32_MAX;
+    for (size_t l = 0; l < width; ++l)
+        pc = std::min(pc, pcs[l] | (live[l] - 1));
+    return pc;
+}
+
+// Marks the live lanes at pc active and returns how many there are.
+inline size_t select(uint32_t* __restrict active, const uint32_t* __restrict pcs,
+                     const uint32_t* __restrict live, uint32_t pc, size_t width)
+{
+    uint32_t count = 0;
+    for (size_t l = 0; l < width; ++l) {
+        active[l] = live[l] & (pcs[l] == pc);
+        count += active[l];
+    }
+    return count;
+}
+
+} // namespace
+
+// The state of the lanes while they run together: every register is a row
+// with a column per lane, and the lanes the current step runs have their
+// column of active set.
+class Lockstep::Warp {
+public:
+    explicit Warp(Lockstep& owner);
+
+    void run();
+
+private:
+    Lockstep& owner;
+    const std::vector<Instruction>& text;
+    const size_t lanes;
+    const size_t width;     // lanes rounded up to whole blocks
+    const uint32_t halt;
+    std::vector<uint32_t> regs;
+    std::vector<uint32_t> hi;
+    std::vector<uint32_t> lo;
+    std::vector<uint32_t> pcs;
+    std::vector<uint32_t> live;
+    std::vector<uint32_t> active;
+    std::vector<size_t> alone;  // lanes to finish on their own VM
+    size_t running;             // lanes still live
+    bool together{false};       // every live lane is active
+
+    uint32_t* reg(uint8_t n) { return regs.data() + n * width; }
+
+    VM& guest(size_t lane) { return *owner.lanes[lane].vm; }
+
+    uint32_t clamp(uint32_t target) const { return target > halt ? halt : target; }
+
+    void load(size_t lane);
+    void store(size_t lane);
+    void finish(size_t lane, int status);
+    void fail(size_t lane, const std::exception& e);
+    void leave(size_t lane);
+    void syscall(size_t lane);
+    bool step(uint32_t pc);
+
+    // Sets d to value for the active lanes. The value is worked out for
+    // a whole block of lanes and then blended in, so neither loop has a
+    // branch to keep the compiler from vectorizing it. When every live lane
+    // is active there's nothing to blend: the columns of the others are
+    // dead, and d is written outright.
+    template<class F>
+    void assign(uint32_t* d, F value)
+    {
+        for (size_t b = 0; b < width; b += block) {
+            uint32_t v[block];
+            for (size_t l = 0; l < block; ++l)
+                v[l] = static_cast<uint32_t>(value(b + l));
+            if (together)
+                memcpy(d + b, v, sizeof v);
+            else
+                blend(d + b, active.data() + b, v);
+        }
+    }
+
+    // Sends the active lanes to their targets, clamped to HALT like JUMP.
+    template<class F>
+    void jump(F target)
+    {
+        assign(pcs.data(), [&](size_t l) { return clamp(static_cast<uint32_t>(target(l))); });
+    }
+
+    // Runs action for each active lane on its own; a lane that throws is
+    // finished with the error.
+    template<class F>
+    void each(F action)
+    {
+        for (size_t l = 0; l < lanes; ++l) {
+            if (!active[l])
+                continue;
+            try {
+                action(l);
+            } catch (const std::exception& e) {
+                fail(l, e);
+            }
+        }
+    }
+};
+
+Lockstep::Warp::Warp(Lockstep& owner)
+        : owner(owner), text(owner.text), lanes(owner.lanes.size()),
+          width((lanes + block - 1) / block * block),
+          halt(static_cast<uint32_t>(owner.text.size() - 1)),
+          regs(32 * width), hi(width), lo(width), pcs(width), live(width), active(width),
+          running(lanes)
+{
+    for (size_t l = 0; l < lanes; ++l) {
+        VM& vm = guest(l);
+        vm.budget = INT64_MAX;
+        vm.cooperative = false;
+        vm.stop_at_syscall = false;
+        vm.state = RunState::Running;
+        load(l);
+        pcs[l] = clamp(pcs[l]);
+        live[l] = 1;
+    }
+}
+
+void Lockstep::Warp::load(size_t lane)
+{
+    VM& vm = guest(lane);
+    for (uint8_t n = 0; n < 32; ++n)
+        reg(n)[lane] = vm.registers[n].word;
+    hi[lane] = vm.hi;
+    lo[lane] = vm.lo;
+    pcs[lane] = vm.program_counter;
+}
+
+void Lockstep::Warp::store(size_t lane)
+{
+    VM& vm = guest(lane);
+    for (uint8_t n = 0; n < 32; ++n)
+        vm.registers[n] = reg(n)[lane];
+    vm.hi = hi[lane];
+    vm.lo = lo[lane];
+    vm.program_counter = pcs[lane];
+}
+
+void Lockstep::Warp::finish(size_t lane, int status)
+{
+    VM& vm = guest(lane);
+    vm.exit_status = status;
+    vm.state = RunState::Exited;
+    live[lane] = 0;
+    running -= 1;
+}
+
+void Lockstep::Warp::fail(size_t lane, const std::exception& e)
+{
+    store(lane);
+    guest(lane).io.flush();
+    owner.lanes[lane].error = error_message(e);
+    finish(lane, 1);
+}
+
+void Lockstep::Warp::leave(size_t lane)
+{
+    store(lane);
+    live[lane] = 0;
+    running -= 1;
+    alone.push_back(lane);
+}
+
+void Lockstep::Warp::syscall(size_t lane)
+{
+    VM& vm = guest(lane);
+    store(lane);
+    // memcpy and memset patch the lane's own text when they write into it,
+    // which the warp's copy doesn't follow. Native handlers' writes aren't
+    // decoded again by any engine, so they can't make the lanes differ.
+    uint32_t number = vm.registers[Register::V0].word;
+    uint32_t address = vm.registers[Register::A0].word;
+    bool patches = (number == 40 || number == 41) && vm.registers[Register::A2].word != 0
+                   && address / 4 < vm.memory.data_segment
+                   && (number >= vm.native_syscalls.size() || !vm.native_syscalls[number]);
+    int status;
+    if (vm.syscall(status)) {
+        finish(lane, status);
+        return;
+    }
+    // Native handlers may have changed any register.
+    load(lane);
+    if (patches)
+        leave(lane);
+}
+
+void Lockstep::Warp::run()
+{
+    uint32_t pc = 0;
+    size_t count = 0;
+    bool scan = true;
+    uint64_t stepped = 0;
+    uint64_t executed = 0;
+    for (;;) {
+        // While every live lane is at the same pc and goes on to the next
+        // instruction, the lanes stay together and the next step runs the
+        // same ones without looking.
+        if (scan) {
+            pc = lowest(pcs.data(), live.data(), width);
+            if (pc == UINT32_MAX)
+                break;
+            count = select(active.data(), pcs.data(), live.data(), pc, width);
+            together = count == running;
+        }
+        stepped += 1;
+        executed += count;
+        size_t before = running;
+        scan = !step(pc) || !together || running != before;
+        pc += 1;
+    }
+    owner.stepped += stepped;
+    owner.executed += executed;
+
+    for (size_t lane : alone) {
+        VM& vm = guest(lane);
+        try {
+            vm.exit_status = vm.execute();
+            owner.lanes[lane].error = vm.error;
+        } catch (const std::exception& e) {
+            owner.lanes[lane].error = error_message(e);
+            vm.exit_status = 1;
+        }
+        vm.state = RunState::Exited;
+    }
+}
+
+// The semantics of Handlers.inc over every active lane at once. Returns
+// whether every active lane just went on to the next instruction.
+bool Lockstep::Warp::step(uint32_t pc)
+{
+    const Instruction& i = text[pc];
+    const uint32_t next = pc + 1;
+    const uint32_t* s = reg(i.rs);
+    const uint32_t* t = reg(i.rt);
+    const int imm = i.immediate;
+
+    switch (i.op) {
+    case Operation::SLL:
+        assign(reg(i.rd), [&](size_t l) { return t[l] << imm; });
+        break;
+    case Operation::SRL:
+        assign(reg(i.rd), [&](size_t l) { return t[l] >> imm; });
+        break;
+    case Operation::SRA:
+        assign(reg(i.rd), [&](size_t l) { return static_cast<int>(t[l]) >> imm; });
+        break;
+    // Host shifts by a register only look at its low five bits.
+    case Operation::SLLV:
+        assign(reg(i.rd), [&](size_t l) { return s[l] << (t[l] & 31); });
+        break;
+    case Operation::SRLV:
+        assign(reg(i.rd), [&](size_t l) { return s[l] >> (t[l] & 31); });
+        break;
+    case Operation::SRAV:
+        assign(reg(i.rd), [&](size_t l) { return static_cast<int>(s[l]) >> (t[l] & 31); });
+        break;
+    case Operation::JR:
+    case Operation::JALR:
+        jump([&](size_t l) { return s[l]; });
+        return false;
+    case Operation::SYSCALL:
+        jump([&](size_t) { return next; });
+        each([&](size_t l) { syscall(l); });
+        return false;
+    case Operation::MFHI:
+        assign(reg(i.rd), [&](size_t l) { return hi[l]; });
+        break;
+    case Operation::MTHI:
+        assign(hi.data(), [&](size_t l) { return s[l]; });
+        break;
+    case Operation::MFLO:
+        assign(reg(i.rd), [&](size_t l) { return lo[l]; });
+        break;
+    case Operation::MTLO:
+        assign(lo.data(), [&](size_t l) { return s[l]; });
+        break;
+    case Operation::MULT:
+        each([&](size_t l) { multiply(s[l], t[l], hi[l], lo[l]); });
+        break;
+    case Operation::MULTU:
+        each([&](size_t l) { multiply_unsigned(s[l], t[l], hi[l], lo[l]); });
+        break;
+    // Division only for the lanes that run it, whose divisors are theirs.
+    case Operation::DIV:
+        each([&](size_t l) { divide(s[l], t[l], hi[l], lo[l]); });
+        break;
+    case Operation::DIVU:
+        each([&](size_t l) { divide_unsigned(s[l], t[l], hi[l], lo[l]); });
+        break;
+    case Operation::ADD:
+    case Operation::ADDU:
+        assign(reg(i.rd), [&](size_t l) { return s[l] + t[l]; });
+        break;
+    case Operation::SUB:
+    case Operation::SUBU:
+        assign(reg(i.rd), [&](size_t l) { return s[l] - t[l]; });
+        break;
+    case Operation::AND:
+        assign(reg(i.rd), [&](size_t l) { return s[l] & t[l]; });
+        break;
+    case Operation::OR:
+        assign(reg(i.rd), [&](size_t l) { return s[l] | t[l]; });
+        break;
+    case Operation::XOR:
+        assign(reg(i.rd), [&](size_t l) { return s[l] ^ t[l]; });
+        break;
+    case Operation::NOR:
+        assign(reg(i.rd), [&](size_t l) { return !(s[l] | t[l]); });
+        break;
+    case Operation::SLT:
+    case Operation::SLTU:
+        assign(reg(i.rd), [&](size_t l) { return s[l] < t[l]; });
+        break;
+    case Operation::J:
+        jump([&](size_t) { return imm; });
+        return false;
+    case Operation::J_OUT_OF_BOUNDS:
+        jump([&](size_t) { return next; });
+        each([&](size_t l) {
+            store(l);
+            guest(l).io.flush();
+            owner.lanes[l].error = "jump out of bounds";
+            finish(l, 2);
+        });
+        return false;
+    case Operation::JAL:
+        assign(reg(31), [&](size_t) { return next; });
+        jump([&](size_t) { return imm; });
+        return false;
+    case Operation::BEQ:
+        jump([&](size_t l) { return s[l] == t[l] ? next + imm : next; });
+        return false;
+    case Operation::BNE:
+        jump([&](size_t l) { return s[l] != t[l] ? next + imm : next; });
+        return false;
+    case Operation::ADDI:
+    case Operation::ADDIU:
+        assign(reg(i.rt), [&](size_t l) { return s[l] + imm; });
+        break;
+    case Operation::SLTI:
+    case Operation::SLTIU:
+        assign(reg(i.rt), [&](size_t l) { return s[l] < static_cast<uint32_t>(imm); });
+        break;
+    case Operation::ANDI:
+        assign(reg(i.rt), [&](size_t l) { return s[l] & imm; });
+        break;
+    case Operation::ORI:
+        assign(reg(i.rt), [&](size_t l) { return s[l] | imm; });
+        break;
+    case Operation::XORI:
+        assign(reg(i.rt), [&](size_t l) { return s[l] ^ imm; });
+        break;
+    case Operation::LUI:
+        assign(reg(i.rt), [&](size_t) { return imm; });
+        break;
+
+    // Memory goes lane by lane, each to its own.
+    case Operation::LB:
+    case Operation::LBU:
+    case Operation::LH:
+    case Operation::LHU:
+    case Operation::LW:
+    case Operation::LWL:
+    case Operation::LWR: {
+        uint32_t* d = reg(i.rt);
+        each([&](size_t l) {
+            const Memory& memory = guest(l).memory;
+            uint32_t address = s[l] + imm;
+            switch (i.op) {
+            case Operation::LB:
+                check(memory, address, 1, Memory::Access::ReadOnly);
+                d[l] = static_cast<int8_t>(memory.load<uint8_t>(address));
+                break;
+            case Operation::LBU:
+                check(memory, address, 1, Memory::Access::ReadOnly);
+                d[l] = memory.load<uint8_t>(address);
+                break;
+            case Operation::LH:
+                check(memory, address & ~1u, 2, Memory::Access::ReadOnly);
+                d[l] = static_cast<int16_t>(memory.load<uint16_t>(address & ~1u));
+                break;
+            case Operation::LHU:
+                check(memory, address & ~1u, 2, Memory::Access::ReadOnly);
+                d[l] = memory.load<uint16_t>(address & ~1u);
+                break;
+            case Operation::LW:
+                check(memory, address & ~3u, 4, Memory::Access::ReadOnly);
+                d[l] = memory.load<uint32_t>(address & ~3u);
+                break;
+            case Operation::LWL: {
+                check(memory, address & ~3u, 4, Memory::Access::ReadOnly);
+                uint32_t shift = (3 - (address & 3)) * 8;
+                uint32_t word = memory.load<uint32_t>(address & ~3u);
+                d[l] = (d[l] & ~(0xFFFFFFFFu << shift)) | (word << shift);
+                break;
+            }
+            default: {
+                check(memory, address & ~3u, 4, Memory::Access::ReadOnly);
+                uint32_t shift = (address & 3) * 8;
+                uint32_t word = memory.load<uint32_t>(address & ~3u);
+                d[l] = (d[l] & ~(0xFFFFFFFFu >> shift)) | (word >> shift);
+                break;
+            }
+            }
+        });
+        break;
+    }
+    case Operation::SB:
+    case Operation::SH:
+    case Operation::SW:
+    case Operation::SWL:
+    case Operation::SWR:
+        jump([&](size_t) { return next; });
+        each([&](size_t l) {
+            VM& vm = guest(l);
+            Memory& memory = vm.memory;
+            uint32_t address = s[l] + imm;
+            switch (i.op) {
+            case Operation::SB:
+                check(memory, address, 1, Memory::Access::ReadWrite);
+                memory.store<uint8_t>(address, static_cast<uint8_t>(t[l]));
+                break;
+            case Operation::SH:
+                address &= ~1u;
+                check(memory, address, 2, Memory::Access::ReadWrite);
+                memory.store<uint16_t>(address, static_cast<uint16_t>(t[l]));
+                break;
+            case Operation::SW:
+                address &= ~3u;
+                check(memory, address, 4, Memory::Access::ReadWrite);
+                memory.store<uint32_t>(address, t[l]);
+                break;
+            case Operation::SWL: {
+                check(memory, address & ~3u, 4, Memory::Access::ReadWrite);
+                uint32_t shift = (3 - (address & 3)) * 8;
+                uint32_t word = memory.load<uint32_t>(address & ~3u);
+                word = (word & ~(0xFFFFFFFFu >> shift)) | (t[l] >> shift);
+                memory.store<uint32_t>(address & ~3u, word);
+                break;
+            }
+            default: {
+                check(memory, address & ~3u, 4, Memory::Access::ReadWrite);
+                uint32_t shift = (address & 3) * 8;
+                uint32_t word = memory.load<uint32_t>(address & ~3u);
+                word = (word & ~(0xFFFFFFFFu << shift)) | (t[l] << shift);
+                memory.store<uint32_t>(address & ~3u, word);
+                break;
+            }
+            }
+            // Its code is no longer the others', so it goes on alone.
+            if ((address >> 2) < halt) {
+                vm.patch_text(address >> 2);
+                leave(l);
+            }
+        });
+        return true;
+    case Operation::UNSUPPORTED_R:
+    case Operation::UNSUPPORTED_I:
+        jump([&](size_t) { return next; });
+        each([&](size_t) {
+            throw std::runtime_error(std::string("Unsupported ")
+                                     + (i.op == Operation::UNSUPPORTED_R ? "r" : "i")
+                                     + "-type operation at " + std::to_string(pc));
+        });
+        return false;
+    case Operation::HALT:
+        jump([&](size_t) { return next; });
+        each([&](size_t l) {
+            store(l);
+            guest(l).dump_registers();
+            guest(l).io.flush();
+            finish(l, 0);
+        });
+        return false;
+    default:
+        // LL, SC and SYNC, which the lanes run on their own VMs from here.
+        each([&](size_t l) { leave(l); });
+        return false;
+    }
+    jump([&](size_t) { return next; });
+    return true;
+}
+
+size_t Lockstep::add(std::unique_ptr<VM> guest)
+{
+    Memory& memory = guest->memory;
+    size_t size = memory.data_segment * sizeof(mem_t);
+    if (lanes.empty()) {
+        text.clear();
+        text.reserve(memory.data_segment + 1);
+        for (size_t index = 0; index < memory.data_segment; ++index)
+            text.push_back(guest->decode(memory[index]));
+        Instruction halt{};
+        halt.op = Operation::HALT;
+        text.push_back(halt);
+    } else {
+        const Memory& first = lanes.front().vm->memory;
+        if (memory.data_segment != first.data_segment || memcmp(memory.data(), first.data(), size) != 0)
+            throw std::invalid_argument("Lanes must run the same program\n");
+    }
+    lanes.push_back(Lane{std::move(guest), std::string()});
+    return lanes.size() - 1;
+}
+
+void Lockstep::run()
+{
+    if (lanes.empty())
+        return;
+    Warp warp(*this);
+    warp.run();
+}
@@ -0,0 +1,76 @@
+#ifndef MIPS_LOCKSTEP_H
+#define MIPS_LOCKSTEP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "VM.h"
+
+// Runs copies of one program in lockstep on the calling thread, one lane per
+// guest, SIMT style.
+//
+// The lanes share a single decoded text and keep their registers as a
+// structure of arrays, a row of lanes per register. Each step picks the
+// lowest pc any lane is at and runs that instruction for every lane there at
+// once, so arithmetic is a loop over a row that the compiler turns into host
+// vector code, and the decoding and dispatch are paid once per step rather
+// than once per lane. Lanes that branch apart are masked off until the
+// others catch up with them; going by the lowest pc brings them back
+// together where the paths of structured code meet again.
+//
+// Loads, stores and syscalls go to each lane's own memory and console I/O.
+// A lane that stores into the text, or reaches an instruction lockstep
+// doesn't run (LL, SC, SYNC), carries on alone on its own VM once the others
+// are done, and so does one whose memcpy or memset syscall writes the text.
+// Probes are not run.
+//
+// This is an experiment rather than a faster engine. Each step still goes
+// through every lane for loads, stores, branches and syscalls, so at 8 lanes
+// a warp runs a straight-line benchmark about 15% slower than the threaded
+// interpreter runs the same jobs one after another; it only comes out ahead
+// with a few dozen lanes, about 1.3 times as fast at 32. What holds it back
+// is the fixed cost of a step, which a warp of one lane pays as well, so
+// the vm command doesn't offer it; Batch::lockstep is there for embedders with
+// that many copies of a program to run.
+class Lockstep {
+public:
+    // Takes over a guest and returns its lane, the index of the guest in
+    // the order added. Every guest must have the text of the first.
+    size_t add(std::unique_ptr<VM> guest);
+
+    // Runs until every lane has exited. Lanes that throw are finished with
+    // status 1 and the message kept as their error.
+    void run();
+
+    VM& guest(size_t lane) { return *lanes[lane].vm; }
+
+    int status(size_t lane) const { return lanes[lane].vm->exit_status; }
+
+    const std::string& error(size_t lane) const { return lanes[lane].error; }
+
+    size_t size() const { return lanes.size(); }
+
+    // Steps taken, and instructions run over all lanes by them; their ratio
+    // is the average number of lanes each step ran.
+    uint64_t steps() const { return stepped; }
+
+    uint64_t instructions() const { return executed; }
+
+private:
+    struct Lane {
+        std::unique_ptr<VM> vm;
+        std::string error;
+    };
+
+    std::vector<Lane> lanes;
+    std::vector<Instruction> text;
+    uint64_t stepped{0};
+    uint64_t executed{0};
+
+    class Warp;
+};
+
+#endif //MIPS_LOCKSTEP_H
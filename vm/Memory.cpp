@@ -0,0 +1,350 @@
+#include "Memory.h"
+
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t guest_space = size_t{1} << 32;
+constexpr size_t guard_size = size_t{1} << 20;
+// Beyond this clear() gives pages back to be zero-filled on the next touch
+// rather than writing zeros over them.
+constexpr size_t clear_in_place = size_t{1} << 18;
+
+thread_local FaultGuard* active_guard = nullptr;
+// The handlers installed before ours, for faults that aren't the guest's.
+struct sigaction previous_segv;
+struct sigaction previous_bus;
+
+size_t page_size()
+{
+    static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return page;
+}
+
+size_t page_align(size_t bytes)
+{
+    return (bytes + page_size() - 1) / page_size() * page_size();
+}
+
+} // namespace
+
+bool Memory::huge_pages = false;
+
+Memory::Memory()
+{
+    void* mapping = mmap(nullptr, guest_space + 2 * guard_size, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED)
+        throw std::runtime_error("Couldn't reserve guest memory\n");
+    reservation = static_cast<uint8_t*>(mapping);
+    bytes = reservation + guard_size;
+}
+
+Memory::~Memory()
+{
+    if (owner)
+        return;
+    if (reservation)
+        munmap(reservation, guest_space + 2 * guard_size);
+    for (const Mapping& mapping : mappings)
+        close(mapping.fd);
+}
+
+Memory::Memory(Memory&& other) noexcept
+        : text_segment(other.text_segment), data_segment(other.data_segment),
+          program_break(other.program_break), stack_segment(other.stack_segment),
+          reservation(other.reservation), bytes(other.bytes), committed(other.committed),
+          mapped(other.mapped), mappings(std::move(other.mappings)), owner(other.owner)
+{
+    other.mappings.clear();
+    other.reservation = nullptr;
+    other.bytes = nullptr;
+    other.committed = 0;
+}
+
+Memory& Memory::operator=(Memory&& other) noexcept
+{
+    if (this != &other) {
+        std::swap(reservation, other.reservation);
+        std::swap(bytes, other.bytes);
+        std::swap(committed, other.committed);
+        std::swap(mapped, other.mapped);
+        std::swap(mappings, other.mappings);
+        std::swap(owner, other.owner);
+        text_segment = other.text_segment;
+        data_segment = other.data_segment;
+        program_break = other.program_break;
+        stack_segment = other.stack_segment;
+    }
+    return *this;
+}
+
+Memory Memory::share() const
+{
+    Memory view{Unreserved()};
+    view.text_segment = text_segment;
+    view.data_segment = data_segment;
+    view.program_break = program_break;
+    view.stack_segment = stack_segment;
+    view.reservation = reservation;
+    view.bytes = bytes;
+    view.committed = committed;
+    view.owner = owner ? owner : this;
+    return view;
+}
+
+void Memory::resize(size_type count)
+{
+    size_t wanted = page_align(count * sizeof(mem_t));
+    size_t current = page_align(committed * sizeof(mem_t));
+    if (wanted > guest_space)
+        throw std::runtime_error("Guest memory exhausted\n");
+
+    if (wanted > current) {
+        for (const Mapping& mapping : mappings)
+            if (mapping.address < wanted)
+                throw std::runtime_error("Guest memory would overlap a mapping\n");
+        if (mprotect(bytes + current, wanted - current, PROT_READ | PROT_WRITE) != 0)
+            throw std::runtime_error("Couldn't commit guest memory\n");
+#ifdef MADV_HUGEPAGE
+        if (huge_pages)
+            madvise(bytes + current, wanted - current, MADV_HUGEPAGE);
+#endif
+    } else if (wanted < current) {
+        // A fresh reservation rather than mprotect, which would leave any
+        // image mapped there in place to show through if memory grows again.
+        if (mmap(bytes + wanted, current - wanted, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+            throw std::runtime_error("Couldn't release guest memory\n");
+    }
+    committed = count;
+}
+
+void Memory::clear()
+{
+    size_t size = page_align(committed * sizeof(mem_t));
+    if (mapped) {
+        // Dropping private pages of a file mapping would bring the file's
+        // contents back, so put fresh anonymous memory there instead.
+        if (mmap(bytes, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+            throw std::runtime_error("Couldn't commit guest memory\n");
+#ifdef MADV_HUGEPAGE
+        if (huge_pages)
+            madvise(bytes, size, MADV_HUGEPAGE);
+#endif
+        mapped = false;
+    } else if (size <= clear_in_place) {
+        memset(bytes, 0, size);
+    } else {
+        madvise(bytes, size, MADV_DONTNEED);
+    }
+}
+
+void Memory::map_image(int fd, uint64_t offset, uint32_t address, size_type size)
+{
+    if (static_cast<uint64_t>(address) + size > page_align(committed * sizeof(mem_t)))
+        throw std::runtime_error("Image mapped outside guest memory\n");
+    void* mapping = mmap(bytes + address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                         fd, static_cast<off_t>(offset));
+    if (mapping == MAP_FAILED)
+        throw std::runtime_error("Couldn't map guest memory image\n");
+    mapped = true;
+}
+
+void Memory::check_free(uint64_t begin, uint64_t end) const
+{
+    if (begin < page_align(committed * sizeof(mem_t)) || end > guest_space)
+        throw std::runtime_error("Mapping outside free guest memory\n");
+    for (const Mapping& mapping : mappings)
+        if (begin < mapping.address + mapping.size && mapping.address < end)
+            throw std::runtime_error("Mapping overlaps another\n");
+}
+
+void Memory::map_file(int fd, uint64_t offset, uint32_t address, size_type size, Access access)
+{
+    if (address % page_size() != 0 || offset % page_size() != 0)
+        throw std::runtime_error("Mapping not page aligned\n");
+    if (size == 0)
+        throw std::runtime_error("Empty mapping\n");
+    check_free(address, address + static_cast<uint64_t>(size));
+
+    // Our own descriptor, for forks to map the same file later.
+    int own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (own < 0)
+        throw std::runtime_error("Couldn't map guest memory\n");
+    int protection = access == Access::ReadWrite ? PROT_READ | PROT_WRITE : PROT_READ;
+    if (mmap(bytes + address, size, protection, MAP_SHARED | MAP_FIXED, own,
+             static_cast<off_t>(offset)) == MAP_FAILED) {
+        close(own);
+        throw std::runtime_error("Couldn't map guest memory\n");
+    }
+    mappings.push_back(Mapping{address, size, own, offset, access});
+}
+
+Memory::size_type Memory::map_file(const std::string& path, uint32_t address, Access access)
+{
+    int fd = open(path.c_str(), access == Access::ReadWrite ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Couldn't open " + path + "\n");
+    struct stat status{};
+    try {
+        if (fstat(fd, &status) != 0)
+            throw std::runtime_error("Couldn't open " + path + "\n");
+        map_file(fd, 0, address, static_cast<size_type>(status.st_size), access);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return static_cast<size_type>(status.st_size);
+}
+
+void Memory::map_buffer(const HostBuffer& buffer, uint32_t address, Access access)
+{
+    map_file(buffer.fd(), 0, address, buffer.size(), access);
+}
+
+void Memory::unmap(uint32_t address)
+{
+    for (auto mapping = mappings.begin(); mapping != mappings.end(); ++mapping) {
+        if (mapping->address != address)
+            continue;
+        if (mmap(bytes + address, page_align(mapping->size), PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+            throw std::runtime_error("Couldn't unmap guest memory\n");
+        close(mapping->fd);
+        mappings.erase(mapping);
+        return;
+    }
+    throw std::runtime_error("Nothing mapped there\n");
+}
+
+void Memory::share_mappings(const Memory& other)
+{
+    for (const Mapping& mapping : other.mappings)
+        map_file(mapping.fd, mapping.offset, mapping.address, mapping.size, mapping.access);
+}
+
+Memory::size_type Memory::extent(uint32_t address, Access access) const
+{
+    if (owner)
+        return owner->extent(address, access);
+    size_type limit = committed * sizeof(mem_t);
+    if (address < limit)
+        return limit;
+    for (const Mapping& mapping : mappings) {
+        if (address < mapping.address || address - mapping.address >= mapping.size)
+            continue;
+        bool allowed = access == Access::ReadOnly || mapping.access == Access::ReadWrite;
+        return allowed ? mapping.address + mapping.size : 0;
+    }
+    return 0;
+}
+
+bool Memory::contains(const void* address) const
+{
+    auto p = static_cast<const uint8_t*>(address);
+    return reservation && p >= reservation && p < reservation + guest_space + 2 * guard_size;
+}
+
+std::ptrdiff_t Memory::guest_address(const void* address) const
+{
+    return static_cast<const uint8_t*>(address) - bytes;
+}
+
+HostBuffer::HostBuffer(std::size_t size)
+        : length(size)
+{
+    if (size == 0)
+        throw std::runtime_error("Empty host buffer\n");
+    file = memfd_create("mips-vm-buffer", MFD_CLOEXEC);
+    if (file < 0)
+        throw std::runtime_error("Couldn't create host buffer\n");
+    void* mapping = MAP_FAILED;
+    if (ftruncate(file, static_cast<off_t>(size)) == 0)
+        mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if (mapping == MAP_FAILED) {
+        close(file);
+        throw std::runtime_error("Couldn't create host buffer\n");
+    }
+    bytes = static_cast<uint8_t*>(mapping);
+}
+
+HostBuffer::~HostBuffer()
+{
+    munmap(bytes, length);
+    close(file);
+}
+
+namespace {
+
+std::string fault_message(std::ptrdiff_t address)
+{
+    std::stringstream ss;
+    ss << "Memory fault at address " << std::showbase << std::hex << address;
+    return ss.str();
+}
+
+} // namespace
+
+MemoryFault::MemoryFault(std::ptrdiff_t address)
+        : std::runtime_error(fault_message(address)), address(address) { }
+
+void handle_fault(int signal, siginfo_t* info, void* context)
+{
+    FaultGuard* guard = active_guard;
+    if (guard && guard->memory.contains(info->si_addr)) {
+        guard->fault = info->si_addr;
+        siglongjmp(guard->env, 1);
+    }
+    // Not a guest access: it's for whoever handled the signal before us, or
+    // crashes the way it would have without a handler once we return.
+    const struct sigaction& previous = signal == SIGBUS ? previous_bus : previous_segv;
+    if (previous.sa_flags & SA_SIGINFO) {
+        previous.sa_sigaction(signal, info, context);
+    } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+        previous.sa_handler(signal);
+    } else {
+        ::signal(signal, SIG_DFL);
+    }
+}
+
+FaultGuard::FaultGuard(const Memory& memory)
+        : memory(memory), previous(active_guard)
+{
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        struct sigaction action{};
+        action.sa_sigaction = handle_fault;
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous_segv);
+        sigaction(SIGBUS, &action, &previous_bus);
+    });
+    active_guard = this;
+}
+
+FaultGuard::~FaultGuard()
+{
+    active_guard = previous;
+}
+
+FaultGuard::Pause::Pause()
+        : paused(active_guard)
+{
+    active_guard = nullptr;
+}
+
+FaultGuard::Pause::~Pause()
+{
+    active_guard = paused;
+}
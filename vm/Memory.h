@@ -0,0 +1,249 @@
+#ifndef MIPS_MEMORY_H
+#define MIPS_MEMORY_H
+
+#include <csetjmp>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using inst_t = uint32_t;
+
+class HostBuffer;
+
+union mem_t {
+    mem_t(uint32_t w = 0) // NOLINT
+            : word(w) { }
+
+    uint32_t word;
+    uint16_t half[2];
+    uint8_t byte[4];
+
+    operator inst_t() { return word; }
+
+    operator int() { return static_cast<int>(word); }
+};
+
+// Guest memory, addressed by byte.
+//
+// The guest is little-endian, matching how the linker lays out data words,
+// and so are the hosts we run on: loads and stores are plain host accesses of
+// the right width, without alignment requirements. operator[] indexes by
+// word, which is how the loaders and the text segment see memory.
+//
+// A single mapping reserves the whole 32-bit guest address space with an
+// inaccessible guard region on either side, so no index computed from a
+// guest address can land outside it. Only the words given to resize() are
+// made readable and writable, and the kernel backs them with zeroed pages on
+// first touch; everything else faults. Faults are turned into MemoryFault by
+// a FaultGuard around execution instead of being checked on every access.
+//
+// Host data can be mapped into the reservation above committed memory, shared
+// rather than copied: files, and HostBuffers for data the host produces.
+class Memory {
+public:
+    using size_type = std::size_t;
+
+    enum class Access {
+        ReadOnly, ReadWrite,
+    };
+
+    Memory();
+    ~Memory();
+
+    Memory(Memory&& other) noexcept;
+    Memory& operator=(Memory&& other) noexcept;
+    Memory(const Memory&) = delete;
+    Memory& operator=(const Memory&) = delete;
+
+    mem_t& operator[](size_type index) { return reinterpret_cast<mem_t*>(bytes)[index]; }
+
+    const mem_t& operator[](size_type index) const { return reinterpret_cast<const mem_t*>(bytes)[index]; }
+
+    uint8_t* data() { return bytes; }
+
+    const uint8_t* data() const { return bytes; }
+
+    template<class T>
+    T load(uint32_t address) const
+    {
+        T value;
+        memcpy(&value, bytes + address, sizeof value);
+        return value;
+    }
+
+    template<class T>
+    void store(uint32_t address, T value)
+    {
+        memcpy(bytes + address, &value, sizeof value);
+    }
+
+    // Sequentially consistent word accesses, for LL and SC from harts
+    // running at once. The address must be word aligned.
+    uint32_t load_atomic(uint32_t address) const
+    {
+        return __atomic_load_n(reinterpret_cast<const uint32_t*>(bytes + address), __ATOMIC_SEQ_CST);
+    }
+
+    // Stores desired if the word still holds expected; returns whether it did.
+    bool compare_exchange(uint32_t address, uint32_t expected, uint32_t desired)
+    {
+        return __atomic_compare_exchange_n(reinterpret_cast<uint32_t*>(bytes + address), &expected, desired,
+                                           false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+
+    // Makes the first count words accessible.
+    void resize(size_type count);
+
+    // Zeroes committed memory, keeping it committed and the reservation in
+    // place.
+    void clear();
+
+    // Maps size bytes of fd at offset over committed memory at the guest
+    // address, copy-on-write: guest stores never reach the file. Both the
+    // address and the offset must be page aligned.
+    void map_image(int fd, uint64_t offset, uint32_t address, size_type size);
+
+    // Another Memory over the same reservation, for harts: stores through
+    // either are seen by the other. It doesn't own the reservation, which
+    // must outlive it, and must not be resized, cleared or mapped into.
+    Memory share() const;
+
+    // Maps size bytes of fd from offset at the guest address, shared with
+    // the file: guest stores go straight to it, and with ReadOnly access they
+    // fault. The range must lie above committed memory and clear of other
+    // mappings, and the address and offset must be page aligned. fd can be
+    // closed afterwards. Mappings outlive clear() and reset, are shared by
+    // forks and aren't saved in snapshots. Files larger than the guest
+    // address space are mapped a window at a time.
+    void map_file(int fd, uint64_t offset, uint32_t address, size_type size, Access access);
+    // The whole file at path; returns its size.
+    size_type map_file(const std::string& path, uint32_t address, Access access);
+    void map_buffer(const HostBuffer& buffer, uint32_t address, Access access);
+    // Removes the mapping at address, which faults again afterwards.
+    void unmap(uint32_t address);
+    // Maps what other has mapped at the same addresses.
+    void share_mappings(const Memory& other);
+
+    size_type size() const { return committed; }
+
+    // End of the accessible range holding the guest byte address: the end of
+    // committed memory or of the mapping, or 0 when neither covers it or the
+    // mapping doesn't allow the access.
+    size_type extent(uint32_t address, Access access = Access::ReadOnly) const;
+
+    // Whether the reservation covers a host address, guards included.
+    bool contains(const void* address) const;
+
+    // Byte offset of a host address from guest address 0.
+    std::ptrdiff_t guest_address(const void* address) const;
+
+    // Ask for transparent huge pages on memory committed from now on.
+    static bool huge_pages;
+
+    size_type text_segment{0};
+    size_type data_segment{0};
+    size_type program_break{0};
+    size_type stack_segment{0};
+
+private:
+    struct Mapping {
+        uint32_t address;
+        size_type size;
+        int fd;             // our own duplicate
+        uint64_t offset;
+        Access access;
+    };
+
+    uint8_t* reservation{nullptr};
+    uint8_t* bytes{nullptr};
+    size_type committed{0};
+    bool mapped{false};     // some of it maps an image
+    std::vector<Mapping> mappings;
+    const Memory* owner{nullptr};   // set when sharing another's reservation
+
+    struct Unreserved { };
+    explicit Memory(Unreserved) { }
+
+    void check_free(uint64_t begin, uint64_t end) const;
+};
+
+// Host memory that guests can map without copying, backed by an anonymous
+// in-memory file. The host fills it through data() and sees what guests
+// store to read-write mappings of it as they do it.
+class HostBuffer {
+public:
+    explicit HostBuffer(std::size_t size);
+    ~HostBuffer();
+
+    HostBuffer(const HostBuffer&) = delete;
+    HostBuffer& operator=(const HostBuffer&) = delete;
+
+    uint8_t* data() { return bytes; }
+
+    const uint8_t* data() const { return bytes; }
+
+    std::size_t size() const { return length; }
+
+    int fd() const { return file; }
+
+private:
+    int file{-1};
+    uint8_t* bytes{nullptr};
+    std::size_t length;
+};
+
+struct MemoryFault : std::runtime_error {
+    explicit MemoryFault(std::ptrdiff_t address);
+
+    std::ptrdiff_t address;
+};
+
+// Catches faults on guest memory for the current thread while alive. Use as
+//
+//     FaultGuard guard(memory);
+//     if (sigsetjmp(guard.env, 1))
+//         throw MemoryFault(guard.address());
+//
+// in the frame that runs guest code. Guards nest. The jump back skips every
+// frame in between, so nothing with a destructor may be live between the
+// sigsetjmp and a guest access. Faults outside guest memory, and any while no
+// guard is active, go to the handlers installed before the first guard.
+class FaultGuard {
+public:
+    explicit FaultGuard(const Memory& memory);
+    ~FaultGuard();
+
+    FaultGuard(const FaultGuard&) = delete;
+    FaultGuard& operator=(const FaultGuard&) = delete;
+
+    // Stops the thread's guard catching faults while alive, around code that
+    // checks its own guest accesses and has frames a jump mustn't skip.
+    class Pause {
+    public:
+        Pause();
+        ~Pause();
+
+        Pause(const Pause&) = delete;
+        Pause& operator=(const Pause&) = delete;
+
+    private:
+        FaultGuard* paused;
+    };
+
+    std::ptrdiff_t address() const { return memory.guest_address(fault); }
+
+    sigjmp_buf env;
+
+private:
+    friend void handle_fault(int, siginfo_t*, void*);
+
+    const Memory& memory;
+    FaultGuard* previous;
+    const void* fault{nullptr};
+};
+
+#endif //MIPS_MEMORY_H
@@ -0,0 +1,185 @@
+#include "Pipeline.h"
+#include "Symbols.h"
+#include "VM.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <string>
+
+namespace {
+
+constexpr uint32_t fill_cycles = 4;
+
+// Whether inst reads register r, ignoring $zero, which is never loaded
+// into anything that matters.
+bool reads(const Instruction& inst, int r)
+{
+    switch (inst.op) {
+    case Operation::SLL:
+    case Operation::SRL:
+    case Operation::SRA:
+        return inst.rt == r;
+    case Operation::JR:
+    case Operation::JALR:
+    case Operation::MTHI:
+    case Operation::MTLO:
+    case Operation::ADDI:
+    case Operation::ADDIU:
+    case Operation::SLTI:
+    case Operation::SLTIU:
+    case Operation::ANDI:
+    case Operation::ORI:
+    case Operation::XORI:
+    case Operation::LB:
+    case Operation::LH:
+    case Operation::LW:
+    case Operation::LBU:
+    case Operation::LHU:
+    case Operation::LL:
+        return inst.rs == r;
+    case Operation::MFHI:
+    case Operation::MFLO:
+    case Operation::LUI:
+    case Operation::J:
+    case Operation::J_OUT_OF_BOUNDS:
+    case Operation::JAL:
+    case Operation::SYNC:
+        return false;
+    case Operation::SYSCALL:
+        return r == 2 || (r >= 4 && r <= 6);
+    default:
+        // Two-register ALU operations, MULT/DIV, branches, stores and the
+        // merging loads.
+        return inst.rs == r || inst.rt == r;
+    }
+}
+
+bool is_load(Operation op)
+{
+    return op >= Operation::LB && op <= Operation::LL;
+}
+
+double cpi(uint64_t cycles, uint64_t instructions)
+{
+    return instructions ? static_cast<double>(cycles) / static_cast<double>(instructions) : 0.0;
+}
+
+} // namespace
+
+PipelineModel::PipelineModel(VM& vm)
+        : vm(vm), blocks(vm.text.size()) { }
+
+void PipelineModel::enter_block(uint32_t pc)
+{
+    if (branch_end) {
+        if (pc != branch_end) {
+            blocks[last_block].cycles += branch_penalty;
+            cycle += branch_penalty;
+            branch_stalls += branch_penalty;
+        }
+        branch_end = 0;
+    }
+
+    Timing& timing = blocks[pc];
+    if (cycle == 0) {
+        timing.cycles += fill_cycles;
+        cycle += fill_cycles;
+    }
+    timing.entries += 1;
+    last_block = pc;
+
+    uint32_t end = std::min<uint32_t>(pc + vm.block_length[pc], static_cast<uint32_t>(vm.memory.data_segment));
+    for (uint32_t n = pc; n < end; ++n) {
+        Instruction inst = vm.decode(vm.memory[n]);
+        uint64_t stall = 0;
+        if (loaded > 0 && reads(inst, loaded)) {
+            stall += load_use_penalty;
+            load_use_stalls += load_use_penalty;
+        }
+        switch (inst.op) {
+        case Operation::MULT:
+        case Operation::MULTU:
+        case Operation::DIV:
+        case Operation::DIVU:
+        case Operation::MFHI:
+        case Operation::MFLO:
+            if (muldiv_ready > cycle + stall) {
+                muldiv_stalls += muldiv_ready - (cycle + stall);
+                stall = muldiv_ready - cycle;
+            }
+            if (inst.op == Operation::MULT || inst.op == Operation::MULTU)
+                muldiv_ready = cycle + stall + mult_latency;
+            else if (inst.op == Operation::DIV || inst.op == Operation::DIVU)
+                muldiv_ready = cycle + stall + div_latency;
+            break;
+        case Operation::J:
+        case Operation::JAL:
+        case Operation::JR:
+        case Operation::JALR:
+            stall += jump_penalty;
+            jump_stalls += jump_penalty;
+            break;
+        case Operation::BEQ:
+        case Operation::BNE:
+            branch_end = n + 1;
+            break;
+        default:
+            break;
+        }
+        loaded = is_load(inst.op) ? inst.rt : -1;
+        cycle += 1 + stall;
+        timing.cycles += 1 + stall;
+        timing.instructions += 1;
+    }
+}
+
+void PipelineModel::report(std::ostream& os, const Symbols& symbols, size_t top) const
+{
+    uint64_t instructions = 0;
+    std::map<std::string, Timing> functions;
+    std::vector<uint32_t> entries;
+    for (uint32_t pc = 0; pc < blocks.size(); ++pc) {
+        const Timing& timing = blocks[pc];
+        if (!timing.entries)
+            continue;
+        instructions += timing.instructions;
+        Timing& function = functions[symbols.name(pc)];
+        function.entries += timing.entries;
+        function.instructions += timing.instructions;
+        function.cycles += timing.cycles;
+        entries.push_back(pc);
+    }
+    std::sort(entries.begin(), entries.end(), [this](uint32_t a, uint32_t b) {
+        return blocks[a].cycles != blocks[b].cycles ? blocks[a].cycles > blocks[b].cycles : a < b;
+    });
+    if (entries.size() > top)
+        entries.resize(top);
+
+    os << std::fixed << std::setprecision(3)
+       << "pipeline: " << cycle << " cycles, " << instructions << " instructions, CPI "
+       << cpi(cycle, instructions) << '\n'
+       << "  stalls: " << load_use_stalls << " load-use, " << branch_stalls << " taken branch, "
+       << jump_stalls << " jump, " << muldiv_stalls << " mult/div\n";
+
+    std::vector<std::pair<std::string, Timing>> by_cycles(functions.begin(), functions.end());
+    std::sort(by_cycles.begin(), by_cycles.end(), [](const std::pair<std::string, Timing>& a,
+                                                     const std::pair<std::string, Timing>& b) {
+        return a.second.cycles > b.second.cycles;
+    });
+    os << "  function                   cycles   instructions     CPI\n";
+    for (auto& function : by_cycles)
+        os << "  " << std::left << std::setw(20) << function.first << std::right
+           << std::setw(14) << function.second.cycles << std::setw(15) << function.second.instructions
+           << std::setw(8) << cpi(function.second.cycles, function.second.instructions) << '\n';
+
+    os << "     address        entries         cycles   instructions     CPI  function\n";
+    for (uint32_t pc : entries) {
+        const Timing& timing = blocks[pc];
+        os << "  0x" << std::hex << std::setw(8) << std::setfill('0') << pc * 4
+           << std::dec << std::setfill(' ') << std::setw(15) << timing.entries
+           << std::setw(15) << timing.cycles << std::setw(15) << timing.instructions
+           << std::setw(8) << cpi(timing.cycles, timing.instructions) << "  " << symbols.name(pc) << '\n';
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef MIPS_PIPELINE_H
+#define MIPS_PIPELINE_H
+
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+class Symbols;
+struct VM;
+
+// Timing model of a classic in-order five-stage MIPS pipeline (IF ID EX MEM
+// WB) with full forwarding, as a probe for the dispatch engines. Every
+// instruction takes one cycle plus its stalls:
+//   - a load followed by an instruction that reads the loaded register
+//     stalls one cycle, the value arriving from MEM too late for EX;
+//   - BEQ and BNE resolve in EX and are predicted not taken, so a taken
+//     branch flushes two instructions; J, JAL, JR and JALR redirect fetch
+//     from ID and lose one;
+//   - MULT and DIV run in a separate unlocked unit, so only MFHI/MFLO or
+//     another MULT/DIV issued before the result is ready wait for it.
+// Filling the pipeline adds four cycles to the first instruction.
+//
+// Instructions are timed a basic block at a time as blocks are entered,
+// decoded from guest memory as written rather than fused; whether a branch
+// was taken shows when the next block is entered.
+class PipelineModel {
+public:
+    static constexpr uint32_t branch_penalty = 2;
+    static constexpr uint32_t jump_penalty = 1;
+    static constexpr uint32_t load_use_penalty = 1;
+    static constexpr uint32_t mult_latency = 12;
+    static constexpr uint32_t div_latency = 35;
+
+    explicit PipelineModel(VM& vm);
+
+    void enter_block(uint32_t pc);
+
+    // Totals and stall breakdown, then cycles and CPI per function and for
+    // the most expensive basic blocks.
+    void report(std::ostream& os, const Symbols& symbols, size_t top = 20) const;
+
+private:
+    struct Timing {
+        uint64_t entries{0};
+        uint64_t instructions{0};
+        uint64_t cycles{0};
+    };
+
+    VM& vm;
+    std::vector<Timing> blocks;     // by entry text index
+    uint64_t cycle{0};
+    uint64_t muldiv_ready{0};       // cycle the HI/LO result is available
+    int loaded{-1};                 // register loaded by the previous instruction
+    uint32_t last_block{0};
+    uint32_t branch_end{0};         // index behind the last block, if it ended in a branch
+    uint64_t load_use_stalls{0};
+    uint64_t branch_stalls{0};
+    uint64_t jump_stalls{0};
+    uint64_t muldiv_stalls{0};
+};
+
+#endif //MIPS_PIPELINE_H
@@ -0,0 +1,100 @@
+#ifndef MIPS_PROBE_H
+#define MIPS_PROBE_H
+
+#include <cstdint>
+
+#include "Cache.h"
+#include "Pipeline.h"
+#include "Profiler.h"
+#include "StackSampler.h"
+#include "Stats.h"
+#include "Trace.h"
+
+// Instrumentation hooks called by the dispatch engines as the guest runs.
+// The engines are instantiated once per probe type, so the empty hooks of
+// NoProbe compile away and the uninstrumented engines pay nothing for them.
+//
+// A probe provides:
+//   enter_block(pc)   control reached the basic block starting at text
+//                     index pc, including where execution starts
+//   call(ret, target) JAL to text index target, returning to index ret
+//   return_to(target) JR $ra, jumping to text index target
+//   syscall(number)   a syscall is about to run
+//   load(address)     a load instruction read guest byte address
+//   store(address)    a store instruction wrote guest byte address
+struct NoProbe {
+    void enter_block(uint32_t) { }
+    void call(uint32_t, uint32_t) { }
+    void return_to(uint32_t) { }
+    void syscall(uint32_t) { }
+    void load(uint32_t) { }
+    void store(uint32_t) { }
+};
+
+// The instruments attached to a VM; the hooks go to each one that is set.
+struct Probes {
+    Profiler* profiler{nullptr};
+    StackSampler* sampler{nullptr};
+    Stats* stats{nullptr};
+    Tracer* tracer{nullptr};
+    CacheModel* cache{nullptr};
+    PipelineModel* pipeline{nullptr};
+
+    explicit operator bool() const { return profiler || sampler || stats || tracer || cache || pipeline; }
+
+    void enter_block(uint32_t pc)
+    {
+        if (profiler)
+            profiler->enter_block(pc);
+        if (sampler)
+            sampler->enter_block(pc);
+        if (stats)
+            stats->enter_block(pc);
+        if (tracer)
+            tracer->enter_block(pc);
+        if (cache)
+            cache->enter_block(pc);
+        if (pipeline)
+            pipeline->enter_block(pc);
+    }
+
+    void call(uint32_t return_index, uint32_t target)
+    {
+        if (sampler)
+            sampler->call(return_index, target);
+    }
+
+    void return_to(uint32_t target)
+    {
+        if (sampler)
+            sampler->return_to(target);
+    }
+
+    void syscall(uint32_t number)
+    {
+        if (stats)
+            stats->syscall(number);
+    }
+
+    void load(uint32_t address)
+    {
+        if (stats)
+            stats->load(address);
+        if (tracer)
+            tracer->load(address);
+        if (cache)
+            cache->load(address);
+    }
+
+    void store(uint32_t address)
+    {
+        if (stats)
+            stats->store(address);
+        if (tracer)
+            tracer->store(address);
+        if (cache)
+            cache->store(address);
+    }
+};
+
+#endif //MIPS_PROBE_H
@@ -0,0 +1,96 @@
+#include "Profiler.h"
+#include "VM.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+
+namespace {
+
+const char* const operation_names[] = {
+#define OPERATION(name) #name,
+#include "Operations.def"
+#undef OPERATION
+};
+
+struct Block {
+    uint32_t entry;
+    uint32_t length;
+    uint64_t entries;
+    uint64_t instructions;
+};
+
+} // namespace
+
+Profiler::Profiler(VM& vm)
+        : vm(vm), entries(vm.text.size()) { }
+
+const char* Profiler::operation(size_t pc) const
+{
+    Operation op = pc < vm.memory.data_segment ? vm.decode(vm.memory[pc]).op : vm.text[pc].op;
+    return operation_names[static_cast<size_t>(op)];
+}
+
+std::vector<uint64_t> Profiler::executions() const
+{
+    // Each entry adds one to its whole block: mark where the run starts and
+    // where it stops, then sum.
+    std::vector<int64_t> delta(entries.size() + 1);
+    for (size_t pc = 0; pc < entries.size(); ++pc) {
+        if (!entries[pc])
+            continue;
+        size_t end = std::min(pc + vm.block_length[pc], entries.size());
+        delta[pc] += static_cast<int64_t>(entries[pc]);
+        delta[end] -= static_cast<int64_t>(entries[pc]);
+    }
+    std::vector<uint64_t> counts(entries.size());
+    int64_t running = 0;
+    for (size_t pc = 0; pc < entries.size(); ++pc) {
+        running += delta[pc];
+        counts[pc] = static_cast<uint64_t>(running);
+    }
+    return counts;
+}
+
+void Profiler::report(std::ostream& os, size_t top) const
+{
+    std::vector<Block> blocks;
+    uint64_t total = 0;
+    for (size_t pc = 0; pc < entries.size(); ++pc) {
+        if (!entries[pc])
+            continue;
+        uint32_t length = vm.block_length[pc];
+        blocks.push_back(Block{static_cast<uint32_t>(pc), length, entries[pc], entries[pc] * length});
+        total += entries[pc] * length;
+    }
+    std::sort(blocks.begin(), blocks.end(), [](const Block& a, const Block& b) {
+        return a.instructions != b.instructions ? a.instructions > b.instructions : a.entry < b.entry;
+    });
+
+    os << "profile: " << total << " instructions in " << blocks.size() << " blocks\n"
+       << "     address  length      entries   instructions   share  first\n";
+    for (size_t n = 0; n < blocks.size() && n < top; ++n) {
+        const Block& block = blocks[n];
+        os << "  0x" << std::hex << std::setw(8) << std::setfill('0') << block.entry * 4
+           << std::dec << std::setfill(' ')
+           << std::setw(8) << block.length
+           << std::setw(13) << block.entries
+           << std::setw(15) << block.instructions
+           << std::setw(7) << std::fixed << std::setprecision(1)
+           << (total ? 100.0 * block.instructions / total : 0.0) << "%  "
+           << operation(block.entry) << '\n';
+    }
+}
+
+void Profiler::write(std::ostream& os) const
+{
+    std::vector<uint64_t> counts = executions();
+    os << "address\texecutions\tentries\toperation\n";
+    for (size_t pc = 0; pc < counts.size(); ++pc) {
+        if (!counts[pc])
+            continue;
+        os << "0x" << std::hex << std::setw(8) << std::setfill('0') << pc * 4
+           << std::dec << std::setfill(' ') << '\t' << counts[pc] << '\t' << entries[pc] << '\t'
+           << operation(pc) << '\n';
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef MIPS_PROFILER_H
+#define MIPS_PROFILER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+struct VM;
+
+// Execution profile of a guest, as a probe for the dispatch engines.
+//
+// Only block entries are counted, in a flat array indexed like the text
+// segment. Every entry at index e runs the instructions from e to the end of
+// its block, so per-instruction counts are recovered afterwards from the
+// block lengths instead of being paid for on every instruction.
+class Profiler {
+public:
+    explicit Profiler(VM& vm);
+
+    void enter_block(uint32_t pc) { ++entries[pc]; }
+
+    // How many times the instruction at each text index ran.
+    std::vector<uint64_t> executions() const;
+
+    // Human-readable summary with the hottest blocks first.
+    void report(std::ostream& os, size_t top = 20) const;
+
+    // One tab-separated line per executed instruction, after a header line:
+    // byte address, executions, block entries and operation, as decoded
+    // rather than fused.
+    void write(std::ostream& os) const;
+
+private:
+    VM& vm;
+    std::vector<uint64_t> entries;
+
+    const char* operation(size_t pc) const;
+};
+
+#endif //MIPS_PROFILER_H
@@ -0,0 +1,78 @@
+#include "Scheduler.h"
+
+#include <deque>
+
+#include <poll.h>
+
+Scheduler::Scheduler(int64_t slice)
+        : slice(slice) { }
+
+size_t Scheduler::add(std::unique_ptr<VM> guest)
+{
+    guests.push_back(Guest{std::move(guest), std::string()});
+    return guests.size() - 1;
+}
+
+RunState Scheduler::resume(Guest& guest)
+{
+    try {
+        RunState state = guest.vm->run(slice);
+        if (state == RunState::Exited)
+            guest.error = guest.vm->error;
+        return state;
+    } catch (const std::exception& e) {
+        guest.error = error_message(e);
+        guest.vm->state = RunState::Exited;
+        guest.vm->exit_status = 1;
+        return RunState::Exited;
+    }
+}
+
+void Scheduler::run()
+{
+    std::deque<size_t> ready;
+    for (size_t id = 0; id < guests.size(); ++id)
+        if (guests[id].vm->state != RunState::Exited)
+            ready.push_back(id);
+    std::vector<size_t> blocked;
+    std::vector<pollfd> waits;
+
+    // Blocked guests are polled once per pass over the ready queue, and
+    // waited for when nothing else can run.
+    size_t until_poll = 0;
+    while (!ready.empty() || !blocked.empty()) {
+        if (!blocked.empty() && (ready.empty() || until_poll == 0)) {
+            waits.clear();
+            for (size_t id : blocked)
+                waits.push_back(pollfd{guests[id].vm->io.input(), POLLIN, 0});
+            if (poll(waits.data(), waits.size(), ready.empty() ? -1 : 0) > 0) {
+                size_t still = 0;
+                for (size_t n = 0; n < blocked.size(); ++n) {
+                    if (waits[n].revents)
+                        ready.push_back(blocked[n]);
+                    else
+                        blocked[still++] = blocked[n];
+                }
+                blocked.resize(still);
+            }
+            until_poll = ready.size();
+        }
+        if (ready.empty())
+            continue;
+
+        size_t id = ready.front();
+        ready.pop_front();
+        if (until_poll > 0)
+            --until_poll;
+        switch (resume(guests[id])) {
+        case RunState::Yielded:
+            ready.push_back(id);
+            break;
+        case RunState::Blocked:
+            blocked.push_back(id);
+            break;
+        default:
+            break;
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef MIPS_SCHEDULER_H
+#define MIPS_SCHEDULER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "VM.h"
+
+// Interleaves many guests on the calling thread.
+//
+// Guests take turns round-robin, each running for a slice of instructions
+// with VM::run before going to the back of the queue. A guest that would
+// block reading input is set aside until poll() reports its input fd
+// readable; while everyone is waiting the thread sleeps in poll().
+class Scheduler {
+public:
+    explicit Scheduler(int64_t slice = 10000);
+
+    // Takes over a guest and returns its id, the index of the guest in the
+    // order added.
+    size_t add(std::unique_ptr<VM> guest);
+
+    // Runs until every guest has exited. Guests that throw are finished with
+    // status 1 and the message kept as their error.
+    void run();
+
+    VM& guest(size_t id) { return *guests[id].vm; }
+
+    int status(size_t id) const { return guests[id].vm->exit_status; }
+
+    const std::string& error(size_t id) const { return guests[id].error; }
+
+    size_t size() const { return guests.size(); }
+
+private:
+    struct Guest {
+        std::unique_ptr<VM> vm;
+        std::string error;
+    };
+
+    int64_t slice;
+    std::vector<Guest> guests;
+
+    RunState resume(Guest& guest);
+};
+
+#endif //MIPS_SCHEDULER_H
@@ -0,0 +1,219 @@
+#include "Snapshot.h"
+#include "VM.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t page_size = SnapshotHeader::page_size;
+
+bool is_zero(const uint8_t* page)
+{
+    static const uint8_t zeros[page_size] = {};
+    return memcmp(page, zeros, page_size) == 0;
+}
+
+uint64_t align_page(uint64_t offset)
+{
+    return (offset + page_size - 1) / page_size * page_size;
+}
+
+void write_at(int fd, const void* data, size_t size, uint64_t offset)
+{
+    auto bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            throw std::runtime_error("Couldn't write snapshot\n");
+        bytes += written;
+        size -= static_cast<size_t>(written);
+        offset += static_cast<uint64_t>(written);
+    }
+}
+
+void read_at(int fd, void* data, size_t size, uint64_t offset)
+{
+    auto bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t got = pread(fd, bytes, size, static_cast<off_t>(offset));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            throw std::runtime_error("Truncated snapshot\n");
+        bytes += got;
+        size -= static_cast<size_t>(got);
+        offset += static_cast<uint64_t>(got);
+    }
+}
+
+bool read_header(int fd, SnapshotHeader& header)
+{
+    return pread(fd, &header, sizeof header, 0) == static_cast<ssize_t>(sizeof header)
+           && header.magic == SnapshotHeader::magic_value
+           && header.version == SnapshotHeader::current_version;
+}
+
+} // namespace
+
+bool is_snapshot(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    SnapshotHeader header;
+    bool snapshot = read_header(fd, header);
+    close(fd);
+    return snapshot;
+}
+
+void save_snapshot(VM& vm, int fd)
+{
+    vm.io.flush();
+
+    SnapshotHeader header{};
+    header.magic = SnapshotHeader::magic_value;
+    header.version = SnapshotHeader::current_version;
+    for (size_t i = 0; i < 32; ++i)
+        header.registers[i] = vm.registers[i].word;
+    header.hi = vm.hi;
+    header.lo = vm.lo;
+    header.program_counter = vm.program_counter;
+    header.text_segment = static_cast<uint32_t>(vm.memory.text_segment);
+    header.data_segment = static_cast<uint32_t>(vm.memory.data_segment);
+    header.program_break = static_cast<uint32_t>(vm.memory.program_break);
+    header.stack_segment = static_cast<uint32_t>(vm.memory.stack_segment);
+    header.committed = static_cast<uint32_t>(vm.memory.size());
+
+    // Untouched memory reads as zero, so only pages with something in them
+    // need saving, and they tend to come in long runs: the program image at
+    // the bottom and the stack at the top.
+    const uint8_t* base = vm.memory.data();
+    auto pages = static_cast<uint32_t>((vm.memory.size() * sizeof(mem_t) + page_size - 1) / page_size);
+    std::vector<SnapshotRun> runs;
+    for (uint32_t page = 0; page < pages; ++page) {
+        if (is_zero(base + page * page_size))
+            continue;
+        if (!runs.empty() && runs.back().first_page + runs.back().pages == page)
+            runs.back().pages += 1;
+        else
+            runs.push_back(SnapshotRun{page, 1, 0});
+    }
+    header.runs = static_cast<uint32_t>(runs.size());
+
+    uint64_t offset = align_page(sizeof header + runs.size() * sizeof(SnapshotRun));
+    for (SnapshotRun& run : runs) {
+        run.offset = offset;
+        offset += static_cast<uint64_t>(run.pages) * page_size;
+    }
+
+    write_at(fd, &header, sizeof header, 0);
+    write_at(fd, runs.data(), runs.size() * sizeof(SnapshotRun), sizeof header);
+    for (const SnapshotRun& run : runs)
+        write_at(fd, base + static_cast<size_t>(run.first_page) * page_size,
+                 static_cast<size_t>(run.pages) * page_size, run.offset);
+    if (ftruncate(fd, static_cast<off_t>(offset)) != 0)
+        throw std::runtime_error("Couldn't write snapshot\n");
+}
+
+// Written next to path and renamed over it: the VM may have been restored
+// from path, and its memory is still backed by that file's pages, which
+// truncating it would take away.
+void save_snapshot(VM& vm, const std::string& path)
+{
+    std::string temporary = path + ".XXXXXX";
+    int fd = mkstemp(&temporary[0]);
+    if (fd < 0)
+        throw std::runtime_error("Couldn't create " + path + "\n");
+    try {
+        if (fchmod(fd, 0644) != 0)
+            throw std::runtime_error("Couldn't create " + path + "\n");
+        save_snapshot(vm, fd);
+        if (close(fd) != 0) {
+            fd = -1;
+            throw std::runtime_error("Couldn't write snapshot\n");
+        }
+        fd = -1;
+        if (rename(temporary.c_str(), path.c_str()) != 0)
+            throw std::runtime_error("Couldn't create " + path + "\n");
+    } catch (...) {
+        if (fd >= 0)
+            close(fd);
+        unlink(temporary.c_str());
+        throw;
+    }
+}
+
+void map_snapshot(Memory& memory, int fd)
+{
+    SnapshotHeader header;
+    if (!read_header(fd, header))
+        throw std::runtime_error("Not a snapshot\n");
+    std::vector<SnapshotRun> runs(header.runs);
+    read_at(fd, runs.data(), runs.size() * sizeof(SnapshotRun), sizeof header);
+
+    // Mapping needs the host's pages to tile ours; otherwise read the pages.
+    static const auto host_page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    for (const SnapshotRun& run : runs) {
+        uint32_t address = run.first_page * SnapshotHeader::page_size;
+        size_t size = static_cast<size_t>(run.pages) * page_size;
+        if (address + size > align_page(memory.size() * sizeof(mem_t)))
+            throw std::runtime_error("Corrupt snapshot\n");
+        if (page_size % host_page == 0)
+            memory.map_image(fd, run.offset, address, size);
+        else
+            read_at(fd, memory.data() + address, size, run.offset);
+    }
+}
+
+Memory load_snapshot_memory(int fd, SnapshotHeader& header)
+{
+    if (!read_header(fd, header))
+        throw std::runtime_error("Not a snapshot\n");
+
+    Memory memory;
+    memory.text_segment = header.text_segment;
+    memory.data_segment = header.data_segment;
+    memory.program_break = header.program_break;
+    memory.stack_segment = header.stack_segment;
+    memory.resize(header.committed);
+    map_snapshot(memory, fd);
+    return memory;
+}
+
+std::unique_ptr<VM> load_snapshot(int fd)
+{
+    SnapshotHeader header;
+    std::unique_ptr<VM> vm(new VM(load_snapshot_memory(fd, header)));
+    for (size_t i = 0; i < 32; ++i)
+        vm->registers[i] = header.registers[i];
+    vm->hi = header.hi;
+    vm->lo = header.lo;
+    vm->program_counter = header.program_counter;
+    return vm;
+}
+
+std::unique_ptr<VM> load_snapshot(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Couldn't open " + path + "\n");
+    try {
+        std::unique_ptr<VM> vm = load_snapshot(fd);
+        close(fd);
+        return vm;
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+}
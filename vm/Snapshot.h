@@ -0,0 +1,68 @@
+#ifndef MIPS_SNAPSHOT_H
+#define MIPS_SNAPSHOT_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+class Memory;
+struct VM;
+
+// Saved state of a running VM: its registers, hi/lo, where it stopped and
+// the pages of guest memory that aren't all zero.
+//
+// The file starts with this header, followed by `runs` SnapshotRun records,
+// each describing consecutive saved pages. Page data sits at file offsets
+// aligned to `page_size`, so a restore maps it straight into guest memory
+// copy-on-write instead of reading it; pages are only brought in as the guest
+// touches them. Pages that weren't saved come back as zeros.
+struct SnapshotHeader {
+    enum : uint32_t {
+        magic_value = 0x5041534D, // "MSAP"
+        current_version = 1,
+        page_size = 4096,
+    };
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t registers[32];
+    uint32_t hi;
+    uint32_t lo;
+    uint32_t program_counter;
+    uint32_t text_segment;  // the Memory segment fields, in words
+    uint32_t data_segment;
+    uint32_t program_break;
+    uint32_t stack_segment;
+    uint32_t committed;     // words of accessible memory
+    uint32_t runs;
+    uint32_t reserved;
+};
+
+struct SnapshotRun {
+    uint32_t first_page;
+    uint32_t pages;
+    uint64_t offset;        // file offset of the first page
+};
+
+bool is_snapshot(const std::string& path);
+
+// Writes the VM's state to fd, which must be positioned at offset 0. Guest
+// output is flushed first; buffered input that the guest hasn't consumed and
+// compiled code are not saved. A path is replaced rather than written in
+// place, so a VM can save over the snapshot it was restored from.
+void save_snapshot(VM& vm, int fd);
+void save_snapshot(VM& vm, const std::string& path);
+
+// A new VM in the saved state. The file can be closed or replaced afterwards
+// but must not be modified in place while the VM is alive.
+std::unique_ptr<VM> load_snapshot(int fd);
+std::unique_ptr<VM> load_snapshot(const std::string& path);
+
+// Just the guest memory of the snapshot in fd, with its header in header.
+Memory load_snapshot_memory(int fd, SnapshotHeader& header);
+
+// Maps the saved pages of the snapshot in fd over memory with the layout it
+// was saved with.
+void map_snapshot(Memory& memory, int fd);
+
+#endif //MIPS_SNAPSHOT_H
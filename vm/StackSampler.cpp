@@ -0,0 +1,56 @@
+#include "StackSampler.h"
+#include "Symbols.h"
+
+#include <ostream>
+#include <string>
+
+StackSampler::StackSampler(const std::vector<uint32_t>& block_length, uint32_t entry, uint64_t period)
+        : block_length(block_length),
+          period(static_cast<int64_t>(period ? period : 1)),
+          countdown(this->period),
+          entry(entry) { }
+
+void StackSampler::return_to(uint32_t target)
+{
+    // Usually the innermost frame. A return further out unwinds the frames
+    // skipped over; one that matches no call is just a jump through $ra.
+    for (size_t n = frames.size(); n-- > 0;) {
+        if (frames[n].return_index == target) {
+            frames.resize(n);
+            return;
+        }
+    }
+}
+
+void StackSampler::sample()
+{
+    uint64_t weight = 0;
+    do {
+        countdown += period;
+        weight += 1;
+    } while (countdown <= 0);
+
+    stack.clear();
+    stack.push_back(entry);
+    for (const Frame& frame : frames)
+        stack.push_back(frame.function);
+    counts[stack] += weight;
+    taken += weight;
+}
+
+void StackSampler::write(std::ostream& os, const Symbols& symbols) const
+{
+    // Different call targets can name the same function.
+    std::map<std::string, uint64_t> folded;
+    for (auto& count : counts) {
+        std::string line;
+        for (uint32_t function : count.first) {
+            if (!line.empty())
+                line += ';';
+            line += symbols.name(function);
+        }
+        folded[line] += count.second;
+    }
+    for (auto& count : folded)
+        os << count.first << ' ' << count.second << '\n';
+}
@@ -0,0 +1,61 @@
+#ifndef MIPS_STACK_SAMPLER_H
+#define MIPS_STACK_SAMPLER_H
+
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <vector>
+
+class Symbols;
+
+// Sampling call-stack profile of a guest, as a probe for the dispatch engines.
+//
+// A shadow stack follows the guest's calls: JAL pushes a frame, JR $ra pops
+// back to the frame it returns from. Every `period` instructions, counted a
+// block at a time, the stack is sampled; a block longer than the period
+// counts for as many samples as periods it spans.
+class StackSampler {
+public:
+    // Samples start from the function containing entry, where the guest
+    // resumes.
+    StackSampler(const std::vector<uint32_t>& block_length, uint32_t entry, uint64_t period);
+
+    void enter_block(uint32_t pc)
+    {
+        if ((countdown -= block_length[pc]) <= 0)
+            sample();
+    }
+
+    void call(uint32_t return_index, uint32_t target)
+    {
+        frames.push_back(Frame{return_index, target});
+    }
+
+    void return_to(uint32_t target);
+
+    uint64_t samples() const { return taken; }
+
+    // Collapsed stacks, the input format of flamegraph tools: one line per
+    // distinct stack, outermost function first, separated by ';', then the
+    // number of samples.
+    void write(std::ostream& os, const Symbols& symbols) const;
+
+private:
+    struct Frame {
+        uint32_t return_index;
+        uint32_t function;
+    };
+
+    const std::vector<uint32_t>& block_length;
+    int64_t period;
+    int64_t countdown;
+    uint64_t taken{0};
+    uint32_t entry;
+    std::vector<Frame> frames;
+    std::vector<uint32_t> stack;
+    std::map<std::vector<uint32_t>, uint64_t> counts;
+
+    void sample();
+};
+
+#endif //MIPS_STACK_SAMPLER_H
@@ -0,0 +1,117 @@
+#include "Stats.h"
+#include "VM.h"
+
+#include <ostream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+// The assembler's mnemonic, or the number for encodings it has no name for.
+template<class Code>
+std::string mnemonic(Code code)
+{
+    std::ostringstream os;
+    os << code;
+    return os.str() == "?" ? std::to_string(static_cast<unsigned>(code)) : os.str();
+}
+
+std::string name_of(Opcode opcode)
+{
+    return opcode == Opcode::R_TYPE ? "special" : mnemonic(opcode);
+}
+
+std::string name_of(Funct funct)
+{
+    return mnemonic(funct);
+}
+
+std::string name_of(uint32_t number)
+{
+    return std::to_string(number);
+}
+
+template<class Key>
+void write_counts(std::ostream& os, const std::map<Key, uint64_t>& counts)
+{
+    os << '{';
+    const char* separator = "";
+    for (auto& count : counts) {
+        os << separator << '"' << name_of(count.first) << "\": " << count.second;
+        separator = ", ";
+    }
+    os << '}';
+}
+
+} // namespace
+
+void Statistics::write_json(std::ostream& os) const
+{
+    os << "{\n"
+       << "  \"instructions\": " << instructions << ",\n"
+       << "  \"opcodes\": ";
+    write_counts(os, opcodes);
+    os << ",\n  \"functs\": ";
+    write_counts(os, functs);
+    os << ",\n  \"branches\": {\"taken\": " << branches_taken
+       << ", \"not_taken\": " << branches_not_taken << "},\n"
+       << "  \"loads\": " << loads << ",\n"
+       << "  \"stores\": " << stores << ",\n"
+       << "  \"syscalls\": ";
+    write_counts(os, syscalls);
+    os << ",\n  \"pages_touched\": " << pages_touched << ",\n"
+       << "  \"seconds\": " << seconds << "\n"
+       << "}\n";
+}
+
+Stats::Stats(VM& vm)
+        : vm(vm), blocks(vm) { }
+
+void Stats::enter_block(uint32_t pc)
+{
+    if (branch_end)
+        ++(pc == branch_end ? not_taken : taken);
+    uint32_t end = pc + vm.block_length[pc];
+    Operation last = vm.text[end - 1].op;
+    branch_end = last == Operation::BEQ || last == Operation::BNE ? end : 0;
+    blocks.enter_block(pc);
+}
+
+Statistics Stats::collect() const
+{
+    Statistics stats;
+    std::vector<bool> touched = pages;
+    std::vector<uint64_t> counts = blocks.executions();
+    for (size_t pc = 0; pc < counts.size() && pc < vm.memory.data_segment; ++pc) {
+        if (!counts[pc])
+            continue;
+        uint32_t word = vm.memory[pc].word;
+        auto opcode = static_cast<Opcode>(word >> 26);
+        stats.instructions += counts[pc];
+        stats.opcodes[opcode] += counts[pc];
+        if (opcode == Opcode::R_TYPE)
+            stats.functs[static_cast<Funct>(word & 0x3F)] += counts[pc];
+        size_t page = pc >> 10;
+        if (page >= touched.size())
+            touched.resize(page + 1);
+        touched[page] = true;
+    }
+    for (bool page : touched)
+        stats.pages_touched += page;
+    stats.branches_taken = taken;
+    stats.branches_not_taken = not_taken;
+    stats.loads = loads;
+    stats.stores = stores;
+    stats.syscalls = syscalls;
+    stats.seconds = seconds;
+    return stats;
+}
+
+Stats::Timer::Timer(Stats* stats)
+        : stats(stats), start(std::chrono::steady_clock::now()) { }
+
+Stats::Timer::~Timer()
+{
+    if (stats)
+        stats->seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,93 @@
+#ifndef MIPS_STATS_H
+#define MIPS_STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <vector>
+
+#include <Funct.h>
+#include <Opcode.h>
+
+#include "Profiler.h"
+
+struct VM;
+
+// Runtime statistics of a guest, as returned by VM::statistics().
+struct Statistics {
+    uint64_t instructions{0};
+    std::map<Opcode, uint64_t> opcodes;     // every instruction retired
+    std::map<Funct, uint64_t> functs;       // the R-type ones among them
+    uint64_t branches_taken{0};             // BEQ and BNE
+    uint64_t branches_not_taken{0};
+    uint64_t loads{0};
+    uint64_t stores{0};
+    std::map<uint32_t, uint64_t> syscalls;  // by number in $v0
+    uint64_t pages_touched{0};              // 4 KiB pages executed, loaded or stored
+    double seconds{0};                      // wall time spent running
+
+    void write_json(std::ostream& os) const;
+};
+
+// Probe behind VM::enable_stats().
+//
+// Retired instructions and the opcode histogram come from block entry counts,
+// as in Profiler, decoding the text once at the end. A block that ends in a
+// conditional branch took it unless the next block entered is the one right
+// behind it, so branch outcomes need no hook in the branch handlers either.
+class Stats {
+public:
+    explicit Stats(VM& vm);
+
+    void enter_block(uint32_t pc);
+
+    void syscall(uint32_t number) { ++syscalls[number]; }
+
+    void load(uint32_t address)
+    {
+        ++loads;
+        touch(address);
+    }
+
+    void store(uint32_t address)
+    {
+        ++stores;
+        touch(address);
+    }
+
+    Statistics collect() const;
+
+    // Times a run of the guest on behalf of Stats, if there is one.
+    class Timer {
+    public:
+        explicit Timer(Stats* stats);
+        ~Timer();
+
+    private:
+        Stats* stats;
+        std::chrono::steady_clock::time_point start;
+    };
+
+private:
+    VM& vm;
+    Profiler blocks;
+    uint32_t branch_end{0};     // index behind the last block, if it ended in a branch
+    uint64_t taken{0};
+    uint64_t not_taken{0};
+    uint64_t loads{0};
+    uint64_t stores{0};
+    std::map<uint32_t, uint64_t> syscalls;
+    std::vector<bool> pages;
+    double seconds{0};
+
+    void touch(uint32_t address)
+    {
+        size_t page = address >> 12;
+        if (page >= pages.size())
+            pages.resize(page + 1);
+        pages[page] = true;
+    }
+};
+
+#endif //MIPS_STATS_H
@@ -0,0 +1,30 @@
+#include "Symbols.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+Symbols Symbols::load(const std::string& path)
+{
+    Symbols symbols;
+    std::ifstream input(path);
+    std::string address, name;
+    while (input >> address >> name)
+        symbols.entries.emplace_back(static_cast<uint32_t>(std::stoul(address, nullptr, 16) >> 2), name);
+    std::sort(symbols.entries.begin(), symbols.entries.end());
+    return symbols;
+}
+
+std::string Symbols::name(uint32_t pc) const
+{
+    auto it = std::upper_bound(entries.begin(), entries.end(), pc,
+                               [](uint32_t pc, const std::pair<uint32_t, std::string>& entry) {
+                                   return pc < entry.first;
+                               });
+    if (it != entries.begin())
+        return std::prev(it)->second;
+    std::ostringstream os;
+    os << "0x" << std::hex << std::setw(8) << std::setfill('0') << pc * 4;
+    return os.str();
+}
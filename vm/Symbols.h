@@ -0,0 +1,26 @@
+#ifndef MIPS_SYMBOLS_H
+#define MIPS_SYMBOLS_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Names for text addresses, from the symbol map the linker writes next to the
+// program (program.sym: one "address name" line per global text symbol).
+class Symbols {
+public:
+    Symbols() = default;
+
+    // An empty table when the file doesn't exist.
+    static Symbols load(const std::string& path);
+
+    // The symbol at or below text index pc, or the address in hex when there
+    // is none.
+    std::string name(uint32_t pc) const;
+
+private:
+    std::vector<std::pair<uint32_t, std::string>> entries; // text index, name
+};
+
+#endif //MIPS_SYMBOLS_H
@@ -0,0 +1,136 @@
+#include "Trace.h"
+#include "VM.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+bool write_all(int fd, const void* data, size_t size)
+{
+    auto bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = ::write(fd, bytes, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        bytes += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+} // namespace
+
+Tracer::Tracer(VM& vm, const std::string& path, size_t capacity)
+        : vm(vm), fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644))
+{
+    if (fd < 0)
+        throw std::runtime_error("Couldn't create " + path + "\n");
+    chunk = capacity / chunks ? capacity / chunks : 1;
+    ring.resize(chunk * chunks);
+
+    TraceHeader header{};
+    header.magic = TraceHeader::magic_value;
+    header.version = TraceHeader::current_version;
+    header.record_size = sizeof(TraceRecord);
+    if (!write_all(fd, &header, sizeof header)) {
+        close(fd);
+        throw std::runtime_error("Couldn't write " + path + "\n");
+    }
+    writer = std::thread(&Tracer::drain, this);
+}
+
+Tracer::~Tracer()
+{
+    stop();
+}
+
+void Tracer::emit_block()
+{
+    // A block that faulted stops at the load or store that didn't complete.
+    uint32_t end = std::min<uint32_t>(block + vm.block_length[block],
+                                      static_cast<uint32_t>(vm.memory.data_segment));
+    size_t access = 0;
+    for (uint32_t pc = block; pc < end; ++pc) {
+        Operation op = vm.text[pc].op;
+        uint32_t effective = 0;
+        if (op >= Operation::LB && op <= Operation::SC) {
+            if (access == addresses.size())
+                break;
+            effective = addresses[access++];
+        }
+        push(TraceRecord{pc * 4, vm.memory[pc].word, effective});
+    }
+}
+
+// Waits until the chunk starting at head is free again.
+void Tracer::reserve()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    drained.wait(lock, [this] { return head + chunk - tail <= ring.size() || failed; });
+}
+
+void Tracer::publish()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        published = head;
+    }
+    ready.notify_one();
+}
+
+// The writer thread: writes published records out in order until stopped.
+void Tracer::drain()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        ready.wait(lock, [this] { return published > tail || stopping; });
+        if (published == tail && stopping)
+            return;
+        uint64_t start = tail;
+        uint64_t end = published;
+        bool ok = !failed;
+        lock.unlock();
+        // Chunks don't straddle the end of the ring, but a run of them can.
+        while (start < end && ok) {
+            size_t index = start % ring.size();
+            size_t count = std::min<uint64_t>(end - start, ring.size() - index);
+            ok = write_all(fd, &ring[index], count * sizeof(TraceRecord));
+            start += count;
+        }
+        lock.lock();
+        failed = !ok;
+        tail = end;
+        drained.notify_one();
+    }
+}
+
+void Tracer::stop()
+{
+    if (!writer.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        published = head;
+        stopping = true;
+    }
+    ready.notify_one();
+    writer.join();
+    close(fd);
+}
+
+void Tracer::finish()
+{
+    if (block != no_block)
+        emit_block();
+    block = no_block;
+    stop();
+    if (failed)
+        throw std::runtime_error("Couldn't write trace\n");
+}
@@ -0,0 +1,101 @@
+#ifndef MIPS_TRACE_H
+#define MIPS_TRACE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct VM;
+
+// Binary instruction trace: this header, then one TraceRecord per executed
+// instruction in execution order, in host byte order.
+struct TraceHeader {
+    enum : uint32_t {
+        magic_value = 0x4352544D, // "MTRC"
+        current_version = 1,
+    };
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;   // sizeof(TraceRecord)
+    uint32_t reserved;
+};
+
+struct TraceRecord {
+    uint32_t address;       // byte address of the instruction
+    uint32_t word;          // the instruction as it was executed
+    uint32_t effective;     // address accessed by loads and stores, else 0
+};
+
+// Records a trace of the guest, as a probe for the dispatch engines.
+//
+// Records go into a fixed-size ring buffer that a background thread drains
+// to the trace file a chunk at a time, so the guest only stops when it gets
+// a whole buffer ahead of the disk. The engines report basic blocks rather
+// than instructions: a block's records are written when the next block is
+// entered, pairing its loads and stores in order with the addresses they
+// reported.
+class Tracer {
+public:
+    // Throws std::runtime_error if the file can't be created.
+    Tracer(VM& vm, const std::string& path, size_t capacity = 1 << 16);
+    ~Tracer();
+
+    void enter_block(uint32_t pc)
+    {
+        if (block != no_block)
+            emit_block();
+        block = pc;
+        addresses.clear();
+    }
+
+    void load(uint32_t address) { addresses.push_back(address); }
+
+    void store(uint32_t address) { addresses.push_back(address); }
+
+    // Writes out the block in progress and the rest of the buffer, then
+    // closes the file. Throws std::runtime_error if writing failed.
+    void finish();
+
+    uint64_t records() const { return head; }
+
+private:
+    static constexpr uint32_t no_block = UINT32_MAX;
+    static constexpr size_t chunks = 8;
+
+    VM& vm;
+    int fd;
+    uint32_t block{no_block};
+    std::vector<uint32_t> addresses;    // reported by the block in progress
+
+    std::vector<TraceRecord> ring;
+    size_t chunk;
+    uint64_t head{0};                   // records produced, owned by the guest thread
+    uint64_t published{0};              // records handed to the writer
+    uint64_t tail{0};                   // records written out
+    bool stopping{false};
+    bool failed{false};
+    std::mutex mutex;
+    std::condition_variable ready;      // more published, or stopping
+    std::condition_variable drained;    // tail moved
+    std::thread writer;
+
+    void emit_block();
+    void push(const TraceRecord& record)
+    {
+        if (head % chunk == 0)
+            reserve();
+        ring[head % ring.size()] = record;
+        if (++head % chunk == 0)
+            publish();
+    }
+    void reserve();
+    void publish();
+    void drain();
+    void stop();
+};
+
+#endif //MIPS_TRACE_H
@@ -1,11 +1,23 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <stdexcept>
 #include "VM.h"
+#include "Harts.h"
+#include "Jit.h"
+#include "Snapshot.h"
 
 #include <Form.h>
+#include <Executable.h>
 #include <iomanip>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 Form hex8(6, std::ios_base::hex, 8, '0');
 
 size_t read_size(std::istream& input)
@@ -18,10 +30,8 @@ size_t read_size(std::istream& input)
     }
 }
 
-Memory load_program(std::istream& input)
+void load_program(Memory& memory, std::istream& input)
 {
-    Memory memory;
-
     std::string line;
     std::getline(input, line);
     std::stringstream ss(line);
@@ -29,277 +39,929 @@ Memory load_program(std::istream& input)
     memory.data_segment = read_size(ss) >> 2;
     memory.program_break = read_size(ss) >> 2;
     memory.stack_segment = 2 * memory.program_break;
-    memory.reserve(memory.stack_segment);
+    memory.resize(memory.stack_segment);
+    size_t index = 0;
     for (std::string line; std::getline(input, line);)
-        memory.push_back(static_cast<uint32_t>(std::stoul(line, nullptr, 16)));
+        memory[index++] = static_cast<uint32_t>(std::stoul(line, nullptr, 16));
+}
+
+Memory load_program(std::istream& input)
+{
+    Memory memory;
+    load_program(memory, input);
+    return memory;
+}
+
+namespace {
+
+// Puts a section of an executable at its guest address. Whole pages are
+// mapped copy-on-write from the file when there is one and the section sits
+// at the same place within a page in both; the rest, or all of it otherwise,
+// is copied.
+void place_section(Memory& memory, int fd, const char* bytes, uint32_t offset, uint32_t address, uint32_t size)
+{
+    static const auto page = static_cast<uint32_t>(sysconf(_SC_PAGESIZE));
+    uint32_t mapped = 0;
+    if (fd >= 0 && offset % page == 0 && address % page == 0)
+        mapped = size / page * page;
+    if (mapped)
+        memory.map_image(fd, offset, address, mapped);
+    memcpy(memory.data() + address + mapped, bytes + offset + mapped, size - mapped);
+}
+
+} // namespace
+
+// Loads the sections of a binary executable into guest memory, mapping them
+// from fd when it is the file data was read from.
+void load_executable(Memory& memory, const void* data, size_t size, int fd = -1)
+{
+    if (!is_executable(data, size))
+        throw std::runtime_error("Not a binary executable\n");
+
+    ExecutableHeader header;
+    memcpy(&header, data, sizeof header);
+    auto bytes = static_cast<const char*>(data);
+
+    memory.text_segment = header.entry >> 2;
+    memory.data_segment = header.text_size >> 2;
+    memory.program_break = (header.text_size + header.data_size) >> 2;
+    memory.stack_segment = 2 * memory.program_break;
     memory.resize(memory.stack_segment);
+    place_section(memory, fd, bytes, header.text_offset, 0, header.text_size);
+    place_section(memory, fd, bytes, header.data_offset, header.text_size, header.data_size);
+}
+
+// Loads an image of a whole executable file, binary or the linker's text
+// output.
+void load_program(Memory& memory, const void* data, size_t size)
+{
+    if (is_executable(data, size)) {
+        load_executable(memory, data, size);
+    } else {
+        std::istringstream input(std::string(static_cast<const char*>(data), size));
+        load_program(memory, input);
+    }
+}
+
+Memory load_program(const void* data, size_t size)
+{
+    Memory memory;
+    load_program(memory, data, size);
     return memory;
 }
 
+// Maps the file and loads it as a binary executable, or parses it as the
+// linker's text output when it is not one.
+Memory load_program(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Couldn't open file.\n");
+
+    struct stat st{};
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        mapping = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (mapping != MAP_FAILED) {
+        auto size = static_cast<size_t>(st.st_size);
+        bool binary = is_executable(mapping, size);
+        Memory memory;
+        try {
+            if (binary)
+                load_executable(memory, mapping, size, fd);
+        } catch (...) {
+            munmap(mapping, size);
+            close(fd);
+            throw;
+        }
+        munmap(mapping, size);
+        if (binary) {
+            close(fd);
+            return memory;
+        }
+    }
+    close(fd);
+
+    std::ifstream input(path);
+    return load_program(input);
+}
+
+VM::VM(const std::string& path)
+        : registers(), memory(load_program(path)), program_counter(memory.text_segment)
+{
+    registers[Register::SP] = memory.stack_segment - 1;
+    decode_text();
+}
+
+VM::VM(Memory image)
+        : registers(), memory(std::move(image)), program_counter(memory.text_segment)
+{
+    registers[Register::SP] = memory.stack_segment - 1;
+    decode_text();
+}
+
+VM::VM(Memory image, const VM& decoded)
+        : registers(), memory(std::move(image)), text(decoded.text), block_length(decoded.block_length),
+          fuse(decoded.fuse), handlers(decoded.handlers), program_counter(memory.text_segment)
+{
+    registers[Register::SP] = memory.stack_segment - 1;
+}
+
+VM::VM(const void* image, size_t size)
+        : registers(), memory(load_program(image, size)), program_counter(memory.text_segment)
+{
+    registers[Register::SP] = memory.stack_segment - 1;
+    decode_text();
+}
+
 VM::VM(std::istream& input)
         : registers(), memory(load_program(input)), program_counter(memory.text_segment)
 {
     registers[Register::SP] = memory.stack_segment - 1;
+    decode_text();
 }
 
-int VM::execute()
+VM::~VM()
 {
-    while (program_counter < memory.data_segment) {
-        inst_t inst = memory[program_counter++];
-        switch (get_opcode(inst)) {
-        case Opcode::R_TYPE:
-            switch (get_funct(inst)) {
-            case Funct::SLL:
-//                std::cout << "sll " << rd(inst) << ' ' << rs(inst) << ' ' << shift_amount(inst) << '\n';
-                destination_reg(inst) = target_reg(inst) << shift_amount(inst);
-                break;
-            case Funct::SRL:
-//               std::cout << "srl " << rd(inst) << ' ' << rs(inst) << ' ' << shift_amount(inst) << '\n';
-                destination_reg(inst) = target_reg(inst) >> shift_amount(inst);
-                break;
-            case Funct::SRA:
-//                std::cout << "sra " << rd(inst) << ' ' << rs(inst) << ' ' << shift_amount(inst) << '\n';
-                destination_reg(inst) = static_cast<int>(target_reg(inst)) >> shift_amount(inst);
-                break;
-            case Funct::SLLV:
-//                std::cout << "sra " << rd(inst) << ' ' << rs(inst) << ' ' << rt(inst) << '\n';
-                destination_reg(inst) = source_reg(inst) << target_reg(inst);
-                break;
-            case Funct::SRLV:
-//                std::cout << "srlv " << rd(inst) << ' ' << rs(inst) << ' ' << rt(inst) << '\n';
-                destination_reg(inst) = source_reg(inst) >> target_reg(inst);
-                break;
-            case Funct::SRAV:
-//                std::cout << "srav " << rd(inst) << ' ' << rs(inst) << ' ' << rt(inst) << '\n';
-                destination_reg(inst) = static_cast<int>(source_reg(inst)) >> target_reg(inst);
-                break;
-            case Funct::JR:
-//                std::cout << "jr " << rs(inst) << '\n';
-                program_counter = source_reg(inst);
-                break;
-            case Funct::JALR:
-//                destination_reg(inst) = program_counter;
-                program_counter = source_reg(inst);
-                break;
-            case Funct::SYSCALL:
-//                std::cout << "syscall ";
-//                std::cout << "$v0 = " << registers[Register::V0].word << '\n';
-                switch (registers[Register::V0].word) {
-                case 1: {
-                    uint32_t value = registers[Register::A0].word;
-                    std::cout << value;
-                    break;
-                }
-                case 4: {
-                    mem_t index = registers[Register::A0].word >> 2;
-                    mem_t* address = &memory[index.word];
-                    uint8_t ch;
-                    while (true) {
-                        ch = address->byte[0];
-                        if (!ch) break;
-                        putchar(ch);
-                        ch = address->byte[1];
-                        if (!ch) break;
-                        putchar(ch);
-                        ch = address->byte[2];
-                        if (!ch) break;
-                        putchar(ch);
-                        ch = address->byte[3];
-                        if (!ch) break;
-                        putchar(ch);
-                        ++address;
-                    }
-                    break;
-                }
-                case 5: {
-                    uint32_t& value = registers[Register::V0].word;
-                    std::cin >> value;
-                    break;
-                }
-                case 10:
-                    std::cout << registers;
-                    return 0;
-                case 11: {
-                    uint32_t value = registers[Register::A0].word;
-                    std::cout << static_cast<char>(value);
-                    break;
-                }
-                case 12: {
-                    uint8_t& value = registers[Register::V0].byte[0];
-                    std::cin >> value;
-                    break;
-                }
-
-                case 17: {
-                    uint32_t value = registers[Register::A0].word;
-                    std::cout << registers;
-                    return value;
-                }
-
-                }
-                break;
-            case Funct::MFHI:
-//                std::cout << "mfhi " << rd(inst) << '\n';
-                destination_reg(inst) = hi;
-                break;
-            case Funct::MTHI:
-//                std::cout << "mthi " << rs(inst) << '\n';
-                hi = source_reg(inst);
-                break;
-            case Funct::MFLO:
-//                std::cout << "mflo " << rd(inst) << '\n';
-                destination_reg(inst) = lo;
-                break;
-            case Funct::MTLO:
-//                std::cout << "mthi " << rs(inst) << '\n';
-                lo = source_reg(inst);
-                break;
-            case Funct::MULT: {
-//                std::cout << "mult " << rs(inst) << ' ' << rt(inst) << '\n';
-                int64_t result = static_cast<int>(source_reg(inst)) * static_cast<int>(target_reg(inst));
-                hi = static_cast<uint32_t>((result & Bitmask<32>::value) >> 32);
-                lo = static_cast<uint32_t>((result & (Bitmask<32>::value << 32)));
-                break;
-            }
-            case Funct::MULTU: {
-//                std::cout << "mult " << rs(inst) << ' ' << rt(inst) << '\n';
-                uint64_t result = source_reg(inst) * target_reg(inst);
-                hi = static_cast<uint32_t>((result & Bitmask<32>::value) >> 32);
-                lo = static_cast<uint32_t>((result & (Bitmask<32>::value << 32)));
-                break;
-            }
-            case Funct::DIV: {
-//                std::cout << "div " << rs(inst) << ' ' << rt(inst) << '\n';
-                lo = static_cast<int>(source_reg(inst)) / static_cast<int>(target_reg(inst));
-                hi = static_cast<int>(source_reg(inst)) % static_cast<int>(target_reg(inst));
-                break;
-            }
-            case Funct::DIVU: {
-//                std::cout << "div " << rs(inst) << ' ' << rt(inst) << '\n';
-                lo = source_reg(inst) / target_reg(inst);
-                hi = source_reg(inst) % target_reg(inst);
-                break;
-            }
-            case Funct::ADD:
-            case Funct::ADDU:
-//                std::cout << "add " << rd(inst) << ' ' << rs(inst) << ' ' << rt(inst) << '\n';
-                destination_reg(inst) = source_reg(inst) + target_reg(inst);
-                break;
-            case Funct::SUB:
-            case Funct::SUBU:
-//                std::cout << "sub " << rd(inst) << ' ' << rs(inst) << ' ' << rt(inst) << '\n';
-                destination_reg(inst) = source_reg(inst) - target_reg(inst);
-                break;
-            case Funct::AND:
-//                std::cout << "and " << rd(inst) << ' ' << rs(inst) << ' ' << rt(inst) << '\n';
-                destination_reg(inst) = source_reg(inst) & target_reg(inst);
-                break;
-            case Funct::OR:
-//                std::cout << "or " << rd(inst) << ' ' << rs(inst) << ' ' << rt(inst) << '\n';
-                destination_reg(inst) = source_reg(inst) | target_reg(inst);
-                break;
-            case Funct::XOR:
-//                std::cout << "xor " << rd(inst) << ' ' << rs(inst) << ' ' << rt(inst) << '\n';
-                destination_reg(inst) = source_reg(inst) ^ target_reg(inst);
-                break;
-            case Funct::NOR:
-//                std::cout << "nor " << rd(inst) << ' ' << rs(inst) << ' ' << rt(inst) << '\n';
-                destination_reg(inst) = !(source_reg(inst) | target_reg(inst));
-                break;
-            case Funct::SLT:
-            case Funct::SLTU:
-//                std::cout << "slt " << rd(inst) << ' ' << rs(inst) << ' ' << rt(inst) << '\n';
-                destination_reg(inst) = source_reg(inst) < target_reg(inst);
-                break;
-            default:
-                throw std::runtime_error("Unsupported r-type operation at " + std::to_string(program_counter - 1));
-            }
-            break;
-        case Opcode::J:
-//            std::cout << "j " << get_address(inst) << '\n';
-            if (get_address(inst) >= memory.stack_segment) {
-                std::cerr << "jump out of bounds \n";
-                exit(2);
-            }
-            program_counter = get_address(inst);
-            break;
-        case Opcode::JAL:
-//            std::cout << "jal " << get_address(inst) << '\n';
-            registers[31] = program_counter;
-            program_counter = get_address(inst);
-            break;
-        case Opcode::BEQ:
-//            std::cout << "beq " << rt(inst) << ' ' << rs(inst) << ' ' << signed_extended_immediate(inst) << '\n';
-            if (source_reg(inst) == target_reg(inst))
-                program_counter += signed_extended_immediate(inst);
-            break;
-        case Opcode::BNE:
-//            std::cout << "bne " << rt(inst) << ' ' << rs(inst) << ' ' << signed_extended_immediate(inst) << '\n';
-            if (source_reg(inst) != target_reg(inst))
-                program_counter += signed_extended_immediate(inst);
-            break;
-        case Opcode::ADDI:
-        case Opcode::ADDIU:
-//            std::cout << "addi " << rt(inst) << ' ' << rs(inst) << ' ' << signed_extended_immediate(inst) << '\n';
-            load_target(inst) = source_reg(inst) + signed_extended_immediate(inst);
-            break;
-        case Opcode::SLTI:
-        case Opcode::SLTIU:
-//            std::cout << "slti " << rt(inst) << ' ' << rs(inst) << ' ' << signed_extended_immediate(inst) << '\n';
-            load_target(inst) = source_reg(inst) < signed_extended_immediate(inst);
-            break;
-        case Opcode::ANDI:
-//            std::cout << "andi " << rt(inst) << ' ' << rs(inst) << ' ' << signed_extended_immediate(inst) << '\n';
-            load_target(inst) = source_reg(inst) & zero_extended_immediate(inst);
-            break;
-        case Opcode::ORI:
-//            std::cout << "ori " << rt(inst) << ' ' << rs(inst) << ' ' << signed_extended_immediate(inst) << '\n';
-            load_target(inst) = source_reg(inst) | zero_extended_immediate(inst);
-            break;
-        case Opcode::XORI:
-//            std::cout << "xori " << rt(inst) << ' ' << rs(inst) << ' ' << signed_extended_immediate(inst) << '\n';
-            load_target(inst) = source_reg(inst) ^ zero_extended_immediate(inst);
+    // Harts run on guest memory and write through our output.
+    spawned.reset();
+    if (fork_image >= 0)
+        close(fork_image);
+}
+
+void VM::reset(const void* image, size_t size)
+{
+    spawned.reset();
+    harts = nullptr;
+    memory.clear();
+    load_program(memory, image, size);
+
+    registers = RegisterFile();
+    registers[Register::SP] = memory.stack_segment - 1;
+    hi = 0;
+    lo = 0;
+    program_counter = static_cast<uint32_t>(memory.text_segment);
+    state = RunState::Running;
+    exit_status = 0;
+    error.clear();
+    stopped_syscall = no_syscall;
+    if (fork_image >= 0) {
+        close(fork_image);
+        fork_image = -1;
+    }
+    fork_image_current = false;
+    probes = Probes();
+    stats.reset();
+    io.reset();
+
+    decode_text();
+    if (jit)
+        jit->invalidate();
+}
+
+void VM::prepare_fork()
+{
+    if (fork_image >= 0 && fork_image_current)
+        return;
+    int fd = memfd_create("mips-vm-fork", MFD_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Couldn't create fork image\n");
+    try {
+        save_snapshot(*this, fd);
+        map_snapshot(memory, fd);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    if (fork_image >= 0)
+        close(fork_image);
+    fork_image = fd;
+    fork_image_current = true;
+}
+
+std::unique_ptr<VM> VM::fork()
+{
+    prepare_fork();
+    // The image holds this VM's text as it stands, so the child can have
+    // the text already decoded, with any patches, instead of decoding it.
+    SnapshotHeader header;
+    std::unique_ptr<VM> child(new VM(load_snapshot_memory(fork_image, header), *this));
+    child->memory.share_mappings(memory);
+    child->registers = registers;
+    child->hi = hi;
+    child->lo = lo;
+    child->program_counter = program_counter;
+    child->dispatch = dispatch;
+    child->jit_threshold = jit_threshold;
+    child->syscalls = syscalls;
+    child->native_syscalls = native_syscalls;
+    return child;
+}
+
+Instruction VM::decode(inst_t inst)
+{
+    Instruction decoded{};
+    decoded.rs = static_cast<uint8_t>(rs(inst));
+    decoded.rt = static_cast<uint8_t>(rt(inst));
+    decoded.rd = static_cast<uint8_t>(rd(inst));
+    decoded.immediate = signed_extended_immediate(inst);
+
+    switch (get_opcode(inst)) {
+    case Opcode::R_TYPE:
+        switch (get_funct(inst)) {
+        case Funct::SLL:
+            decoded.op = Operation::SLL;
+            decoded.immediate = shift_amount(inst);
             break;
-        case Opcode::LUI:
-//            std::cout << "lui " << rt(inst) << ' ' << rs(inst) << ' ' << signed_extended_immediate(inst) << '\n';
-            load_target(inst) = zero_extended_immediate(inst) << 16;
+        case Funct::SRL:
+            decoded.op = Operation::SRL;
+            decoded.immediate = shift_amount(inst);
             break;
-        case Opcode::LW:
-//            std::cout << "lw " << rt(inst) << ' ' << rs(inst) << ' ' << signed_extended_immediate(inst) << '\n';
-            load_target(inst) = memory[(source_reg(inst) + signed_extended_immediate(inst)) >> 2];
+        case Funct::SRA:
+            decoded.op = Operation::SRA;
+            decoded.immediate = shift_amount(inst);
             break;
-        case Opcode::SW:
-//            std::cout << "sw " << rt(inst) << ' ' << rs(inst) << ' ' << signed_extended_immediate(inst) << '\n';
-            memory[(source_reg(inst) + signed_extended_immediate(inst)) >> 2] = target_reg(inst);
+        case Funct::SLLV: decoded.op = Operation::SLLV; break;
+        case Funct::SRLV: decoded.op = Operation::SRLV; break;
+        case Funct::SRAV: decoded.op = Operation::SRAV; break;
+        case Funct::JR: decoded.op = Operation::JR; break;
+        case Funct::JALR: decoded.op = Operation::JALR; break;
+        case Funct::SYSCALL: decoded.op = Operation::SYSCALL; break;
+        case Funct::SYNC: decoded.op = Operation::SYNC; break;
+        case Funct::MFHI: decoded.op = Operation::MFHI; break;
+        case Funct::MTHI: decoded.op = Operation::MTHI; break;
+        case Funct::MFLO: decoded.op = Operation::MFLO; break;
+        case Funct::MTLO: decoded.op = Operation::MTLO; break;
+        case Funct::MULT: decoded.op = Operation::MULT; break;
+        case Funct::MULTU: decoded.op = Operation::MULTU; break;
+        case Funct::DIV: decoded.op = Operation::DIV; break;
+        case Funct::DIVU: decoded.op = Operation::DIVU; break;
+        case Funct::ADD: decoded.op = Operation::ADD; break;
+        case Funct::ADDU: decoded.op = Operation::ADDU; break;
+        case Funct::SUB: decoded.op = Operation::SUB; break;
+        case Funct::SUBU: decoded.op = Operation::SUBU; break;
+        case Funct::AND: decoded.op = Operation::AND; break;
+        case Funct::OR: decoded.op = Operation::OR; break;
+        case Funct::XOR: decoded.op = Operation::XOR; break;
+        case Funct::NOR: decoded.op = Operation::NOR; break;
+        case Funct::SLT: decoded.op = Operation::SLT; break;
+        case Funct::SLTU: decoded.op = Operation::SLTU; break;
+        default: decoded.op = Operation::UNSUPPORTED_R; break;
+        }
+        break;
+    case Opcode::J:
+        // The target is fixed, so check it here rather than on every jump.
+        decoded.immediate = get_address(inst);
+        decoded.op = static_cast<uint32_t>(decoded.immediate) < memory.stack_segment
+                     ? Operation::J : Operation::J_OUT_OF_BOUNDS;
+        break;
+    case Opcode::JAL:
+        decoded.op = Operation::JAL;
+        decoded.immediate = get_address(inst);
+        break;
+    case Opcode::BEQ: decoded.op = Operation::BEQ; break;
+    case Opcode::BNE: decoded.op = Operation::BNE; break;
+    case Opcode::ADDI: decoded.op = Operation::ADDI; break;
+    case Opcode::ADDIU: decoded.op = Operation::ADDIU; break;
+    case Opcode::SLTI: decoded.op = Operation::SLTI; break;
+    case Opcode::SLTIU: decoded.op = Operation::SLTIU; break;
+    case Opcode::ANDI:
+        decoded.op = Operation::ANDI;
+        decoded.immediate = zero_extended_immediate(inst);
+        break;
+    case Opcode::ORI:
+        decoded.op = Operation::ORI;
+        decoded.immediate = zero_extended_immediate(inst);
+        break;
+    case Opcode::XORI:
+        decoded.op = Operation::XORI;
+        decoded.immediate = zero_extended_immediate(inst);
+        break;
+    case Opcode::LUI:
+        decoded.op = Operation::LUI;
+        decoded.immediate = zero_extended_immediate(inst) << 16;
+        break;
+    case Opcode::LB: decoded.op = Operation::LB; break;
+    case Opcode::LH: decoded.op = Operation::LH; break;
+    case Opcode::LWL: decoded.op = Operation::LWL; break;
+    case Opcode::LW: decoded.op = Operation::LW; break;
+    case Opcode::LBU: decoded.op = Operation::LBU; break;
+    case Opcode::LHU: decoded.op = Operation::LHU; break;
+    case Opcode::LWR: decoded.op = Operation::LWR; break;
+    case Opcode::LL: decoded.op = Operation::LL; break;
+    case Opcode::SB: decoded.op = Operation::SB; break;
+    case Opcode::SH: decoded.op = Operation::SH; break;
+    case Opcode::SWL: decoded.op = Operation::SWL; break;
+    case Opcode::SW: decoded.op = Operation::SW; break;
+    case Opcode::SWR: decoded.op = Operation::SWR; break;
+    case Opcode::SC: decoded.op = Operation::SC; break;
+    default: decoded.op = Operation::UNSUPPORTED_I; break;
+    }
+    if (handlers)
+        decoded.handler = handlers[static_cast<size_t>(decoded.op)];
+    return decoded;
+}
+
+// Everything below the data segment is executable, so decode it once up front
+// and let the engines work from the records instead of the raw words. One
+// extra HALT record sits past the end so falling off the text needs no check.
+void VM::decode_text()
+{
+    fork_image_current = false;
+    text.clear();
+    text.reserve(memory.data_segment + 1);
+    for (size_t i = 0; i < memory.data_segment; ++i)
+        text.push_back(decode(memory[i]));
+
+    Instruction halt{};
+    halt.op = Operation::HALT;
+    if (handlers)
+        halt.handler = handlers[static_cast<size_t>(Operation::HALT)];
+    text.push_back(halt);
+
+    if (fuse)
+        for (size_t i = 0; i < memory.data_segment; ++i)
+            fuse_text(i);
+
+    block_length.assign(text.size(), 0);
+    measure_blocks(text.size() - 1);
+}
+
+namespace {
+
+// Whether a record ends its basic block, as the handlers that finish with
+// END_BLOCK or EXIT do. Superinstructions keep the branch that ends them in a
+// record of its own, so they are counted as the plain sequence they stand for.
+bool ends_block(Operation op)
+{
+    switch (op) {
+    case Operation::JR:
+    case Operation::JALR:
+    case Operation::SYSCALL:
+    case Operation::J:
+    case Operation::J_OUT_OF_BOUNDS:
+    case Operation::JAL:
+    case Operation::BEQ:
+    case Operation::BNE:
+    case Operation::HALT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+} // namespace
+
+// Recomputes block_length backwards from index last, stopping once the
+// lengths before it come out unchanged.
+void VM::measure_blocks(size_t last)
+{
+    for (size_t n = last + 1; n-- > 0;) {
+        uint32_t length = ends_block(text[n].op) ? 1 : 1 + block_length[n + 1];
+        if (length == block_length[n] && n < last)
             break;
+        block_length[n] = length;
+    }
+}
+
+void VM::patch_text(size_t index)
+{
+    fork_image_current = false;
+    text[index] = decode(memory[index]);
+    measure_blocks(index);
+    if (jit)
+        jit->invalidate();
+    if (!fuse)
+        return;
+    // The store may have created or broken a sequence starting up to two
+    // words earlier.
+    for (size_t i = index < 2 ? 0 : index - 2; i <= index; ++i)
+        fuse_text(i);
+}
+
+// Turns the record at index into a superinstruction when it starts one of the
+// sequences the assembler emits over and over: lui/ori from li and la, a
+// compare feeding a branch, and a loop increment followed by its back edge.
+// Operations are taken from memory rather than from the records, which may
+// already have been fused themselves.
+void VM::fuse_text(size_t index)
+{
+    auto operation = [this](size_t n) {
+        return n < memory.data_segment ? decode(memory[n]).op : Operation::HALT;
+    };
+    auto is_add = [](Operation op) { return op == Operation::ADDI || op == Operation::ADDIU; };
+    auto is_slt = [](Operation op) { return op == Operation::SLT || op == Operation::SLTU; };
+
+    Operation first = operation(index);
+    Operation second = operation(index + 1);
+    Operation fused = first;
+
+    if (first == Operation::LUI && second == Operation::ORI) {
+        fused = Operation::LUI_ORI;
+    } else if (is_slt(first)) {
+        if (second == Operation::BEQ)
+            fused = Operation::SLT_BEQ;
+        else if (second == Operation::BNE)
+            fused = Operation::SLT_BNE;
+    } else if (is_add(first)) {
+        Operation third = operation(index + 2);
+        if (second == Operation::BEQ)
+            fused = Operation::ADDIU_BEQ;
+        else if (second == Operation::BNE)
+            fused = Operation::ADDIU_BNE;
+        else if (is_slt(second) && third == Operation::BEQ)
+            fused = Operation::ADDIU_SLT_BEQ;
+        else if (is_slt(second) && third == Operation::BNE)
+            fused = Operation::ADDIU_SLT_BNE;
+    }
+
+    text[index].op = fused;
+    if (handlers)
+        text[index].handler = handlers[static_cast<size_t>(fused)];
+}
+
+namespace {
+
+// The built-in syscalls, by the number they go under in builtin_syscalls().
+
+bool ignore(VM&, int&)
+{
+    return false;
+}
+
+bool print_int(VM& vm, int&)
+{
+    vm.io.write_uint(vm.registers[Register::A0].word);
+    return false;
+}
+
+bool print_string(VM& vm, int&)
+{
+    uint32_t address = vm.registers[Register::A0].word;
+    size_t limit = vm.memory.extent(address);
+    // Running off the end of memory faults, as reading it byte by byte would.
+    if (address >= limit)
+        throw MemoryFault(address);
+    if (!vm.io.write_string(vm.memory.data() + address, limit - address))
+        throw MemoryFault(static_cast<std::ptrdiff_t>(limit));
+    return false;
+}
+
+bool read_int(VM& vm, int&)
+{
+    if (vm.cooperative && vm.io.would_block())
+        return vm.block();
+    vm.io.read_uint(vm.registers[Register::V0].word);
+    return false;
+}
+
+bool exit_program(VM& vm, int& status)
+{
+    vm.dump_registers();
+    vm.io.flush();
+    status = 0;
+    return true;
+}
+
+bool print_char(VM& vm, int&)
+{
+    vm.io.put(static_cast<char>(vm.registers[Register::A0].word));
+    return false;
+}
+
+bool read_char(VM& vm, int&)
+{
+    if (vm.cooperative && vm.io.would_block())
+        return vm.block();
+    vm.io.read_char(vm.registers[Register::V0].byte[0]);
+    return false;
+}
+
+bool exit_with_status(VM& vm, int& status)
+{
+    vm.dump_registers();
+    vm.io.flush();
+    status = static_cast<int>(vm.registers[Register::A0].word);
+    return true;
+}
+
+// The C library's memory and string functions, run natively over guest
+// memory: $a0, $a1 and $a2 are the arguments and $v0 the result, with guest
+// addresses in place of pointers.
+
+// Overlapping ranges are fine.
+bool guest_memcpy(VM& vm, int&)
+{
+    uint32_t dst = vm.registers[Register::A0].word;
+    uint32_t src = vm.registers[Register::A1].word;
+    uint32_t size = vm.registers[Register::A2].word;
+    vm.check_range(src, size);
+    vm.check_range(dst, size, Memory::Access::ReadWrite);
+    memmove(vm.memory.data() + dst, vm.memory.data() + src, size);
+    vm.patch_range(dst, size);
+    vm.registers[Register::V0] = dst;
+    return false;
+}
+
+bool guest_memset(VM& vm, int&)
+{
+    uint32_t dst = vm.registers[Register::A0].word;
+    uint32_t size = vm.registers[Register::A2].word;
+    vm.check_range(dst, size, Memory::Access::ReadWrite);
+    memset(vm.memory.data() + dst, static_cast<uint8_t>(vm.registers[Register::A1].word), size);
+    vm.patch_range(dst, size);
+    vm.registers[Register::V0] = dst;
+    return false;
+}
+
+// The result is -1, 0 or 1.
+bool guest_memcmp(VM& vm, int&)
+{
+    uint32_t lhs = vm.registers[Register::A0].word;
+    uint32_t rhs = vm.registers[Register::A1].word;
+    uint32_t size = vm.registers[Register::A2].word;
+    vm.check_range(lhs, size);
+    vm.check_range(rhs, size);
+    int result = memcmp(vm.memory.data() + lhs, vm.memory.data() + rhs, size);
+    vm.registers[Register::V0] = static_cast<uint32_t>((result > 0) - (result < 0));
+    return false;
+}
+
+bool guest_strlen(VM& vm, int&)
+{
+    vm.registers[Register::V0] = vm.string_length(vm.registers[Register::A0].word);
+    return false;
+}
+
+// 0 when not found.
+bool guest_memchr(VM& vm, int&)
+{
+    uint32_t str = vm.registers[Register::A0].word;
+    uint32_t size = vm.registers[Register::A2].word;
+    vm.check_range(str, size);
+    auto found = static_cast<const uint8_t*>(
+            memchr(vm.memory.data() + str, static_cast<uint8_t>(vm.registers[Register::A1].word), size));
+    vm.registers[Register::V0] = found ? static_cast<uint32_t>(found - vm.memory.data()) : 0;
+    return false;
+}
+
+// Snapshot to the file named by $a0: 0 here, 1 once restored.
+bool take_snapshot(VM& vm, int&)
+{
+    uint32_t name = vm.registers[Register::A0].word;
+    std::string path(reinterpret_cast<const char*>(vm.memory.data() + name), vm.string_length(name));
+    vm.registers[Register::V0] = 1;
+    try {
+        save_snapshot(vm, path);
+        vm.registers[Register::V0] = 0;
+    } catch (const std::runtime_error&) {
+        vm.registers[Register::V0] = static_cast<uint32_t>(-1);
+    }
+    return false;
+}
+
+// Starts a hart at the text address in $a0, with $a1 in its $a0 and $a2 as
+// its stack pointer: $v0 is its id, or -1 for an address outside the text.
+bool spawn_hart(VM& vm, int&)
+{
+    uint32_t entry = vm.registers[Register::A0].word / 4;
+    if (entry >= vm.memory.data_segment) {
+        vm.registers[Register::V0] = static_cast<uint32_t>(-1);
+        return false;
+    }
+    if (!vm.harts) {
+        vm.spawned.reset(new Harts(vm));
+        vm.harts = vm.spawned.get();
+    }
+    vm.registers[Register::V0] = vm.harts->spawn(vm, entry, vm.registers[Register::A1].word,
+                                                 vm.registers[Register::A2].word);
+    return false;
+}
+
+// Waits for the hart in $a0 to finish: $v0 is its exit status, or -1 when it
+// faulted or can't be waited for.
+bool join_hart(VM& vm, int&)
+{
+    uint32_t id = vm.registers[Register::A0].word;
+    int status = vm.harts && id != vm.hart ? vm.harts->join(id) : -1;
+    vm.registers[Register::V0] = static_cast<uint32_t>(status);
+    return false;
+}
+
+bool run_native(VM& vm, int&)
+{
+    vm.native_syscalls[vm.registers[Register::V0].word](vm.registers, vm.memory);
+    return false;
+}
+
+} // namespace
+
+const std::vector<SyscallHandler>& VM::builtin_syscalls()
+{
+    static const std::vector<SyscallHandler> table = [] {
+        std::vector<SyscallHandler> handlers(62, ignore);
+        handlers[1] = print_int;
+        handlers[4] = print_string;
+        handlers[5] = read_int;
+        handlers[10] = exit_program;
+        handlers[11] = print_char;
+        handlers[12] = read_char;
+        handlers[17] = exit_with_status;
+        handlers[40] = guest_memcpy;
+        handlers[41] = guest_memset;
+        handlers[42] = guest_memcmp;
+        handlers[43] = guest_strlen;
+        handlers[44] = guest_memchr;
+        handlers[50] = take_snapshot;
+        handlers[60] = spawn_hart;
+        handlers[61] = join_hart;
+        return handlers;
+    }();
+    return table;
+}
+
+void VM::register_syscall(uint32_t number, NativeSyscall handler)
+{
+    if (number >= syscall_limit)
+        throw std::out_of_range("Syscall number out of range\n");
+    if (number >= syscalls.size())
+        syscalls.resize(number + 1, ignore);
+    if (number >= native_syscalls.size())
+        native_syscalls.resize(number + 1);
+
+    native_syscalls[number] = std::move(handler);
+    const std::vector<SyscallHandler>& builtins = builtin_syscalls();
+    if (native_syscalls[number])
+        syscalls[number] = run_native;
+    else
+        syscalls[number] = number < builtins.size() ? builtins[number] : ignore;
+}
+
+// Unknown numbers do nothing. Handlers check their guest accesses rather
+// than leave them to the fault guard, whose jump would skip their frames.
+bool VM::syscall(int& status)
+{
+    FaultGuard::Pause unguarded;
+    uint32_t number = registers[Register::V0].word;
+    return number < syscalls.size() && syscalls[number](*this, status);
+}
+
+// Length of the NUL-terminated string at address, faulting where a guest
+// loop looking for the terminator would.
+uint32_t VM::string_length(uint32_t address)
+{
+    size_t limit = memory.extent(address);
+    if (address >= limit)
+        throw MemoryFault(address);
+    auto end = static_cast<const uint8_t*>(memchr(memory.data() + address, 0, limit - address));
+    if (!end)
+        throw MemoryFault(static_cast<std::ptrdiff_t>(limit));
+    return static_cast<uint32_t>(end - (memory.data() + address));
+}
+
+// Throws the fault a byte-by-byte guest loop would hit when [address,
+// address + size) runs outside committed memory or the mapping it starts in.
+void VM::check_range(uint32_t address, uint32_t size, Memory::Access access)
+{
+    size_t limit = memory.extent(address, access);
+    if (address >= limit && size > 0)
+        throw MemoryFault(address);
+    if (size > limit - address)
+        throw MemoryFault(static_cast<std::ptrdiff_t>(limit));
+}
+
+// Re-decodes the text words a bulk store into [address, address + size)
+// touched.
+void VM::patch_range(uint32_t address, uint32_t size)
+{
+    if (size == 0)
+        return;
+    size_t end = std::min<size_t>((address + static_cast<size_t>(size) - 1) / 4 + 1, memory.data_segment);
+    for (size_t index = address / 4; index < end; ++index)
+        patch_text(index);
+}
+
+void VM::dump_registers()
+{
+    // Only the exit of the program's own hart shows them.
+    if (hart != 0)
+        return;
+    std::ostringstream dump;
+    dump << registers;
+    io.write(dump.str());
+}
+
+int VM::execute()
+{
+    budget = INT64_MAX;
+    cooperative = false;
+    stop_at_syscall = false;
+    state = RunState::Running;
+    int status = enter();
+    if (spawned)
+        spawned->join_all();
+    return status;
+}
+
+RunState VM::run(int64_t instructions, bool until_syscall)
+{
+    budget = instructions;
+    cooperative = true;
+    stop_at_syscall = until_syscall;
+    state = RunState::Running;
+    int status = enter();
+    if (state == RunState::Running) {
+        state = RunState::Exited;
+        exit_status = status;
+    }
+    return state;
+}
+
+void VM::enable_stats()
+{
+    stats.reset(new Stats(*this));
+    probes.stats = stats.get();
+}
+
+Statistics VM::statistics() const
+{
+    return stats ? stats->collect() : Statistics();
+}
+
+// Leaves the engine from a syscall that would wait for input.
+bool VM::block()
+{
+    state = RunState::Blocked;
+    return true;
+}
+
+int VM::enter()
+{
+    // Running may change memory the fork image no longer matches.
+    fork_image_current = false;
+
+    // Made before the jump point below, which a fault returns to without
+    // running the destructors of anything made after it.
+    Stats::Timer timer(probes.stats);
+    NoProbe none;
+
+    // Guest accesses outside committed memory come back here as a fault.
+    FaultGuard guard(memory);
+    if (sigsetjmp(guard.env, 1)) {
+        io.flush();
+        throw MemoryFault(guard.address());
+    }
+
+    try {
+        // Instrumented runs need every block entry to go through the interpreter.
+        if (probes)
+            return dispatch == Dispatch::Switch ? run_switch(probes) : run_threaded(probes);
+        switch (dispatch) {
+        case Dispatch::Threaded:
+            return run_threaded(none);
+        case Dispatch::Jit:
+            return cooperative ? run_threaded(none) : run_jit();
+        case Dispatch::Switch:
         default:
-            throw std::runtime_error("Unsupported i-type operation at " + std::to_string(program_counter - 1));
+            return run_switch(none);
         }
+    } catch (...) {
+        io.flush();
+        throw;
     }
-    std::cout << registers;
-    return 0;
 }
 
-int main(int argc, char** argv)
+#define JUMP(target) \
+    do { pc = (target); if (pc > halt) pc = halt; } while (0)
+#define EXIT(status) \
+    do { program_counter = pc; return (status); } while (0)
+#define CHARGE_BLOCK() \
+    do { \
+        if ((remaining -= lengths[pc]) < 0) { \
+            state = RunState::Yielded; \
+            EXIT(0); \
+        } \
+    } while (0)
+
+template<class Probe>
+int VM::run_switch(Probe& probe)
 {
-    if (argc != 2) {
-        std::cerr << "usage: " << argv[0] << " file\n";
-        exit(1);
+    RegisterFile& reg = registers;
+    const Instruction* base = text.data();
+    const uint32_t halt = static_cast<uint32_t>(text.size() - 1);
+    const uint32_t* lengths = block_length.data();
+    int64_t remaining = budget;
+    uint32_t pc = program_counter;
+
+    probe.enter_block(pc);
+    for (;;) {
+        const Instruction* i = &base[pc++];
+        switch (i->op) {
+#define HANDLER(name) case Operation::name:
+#define NEXT() continue
+#define END_BLOCK() { CHARGE_BLOCK(); probe.enter_block(pc); continue; }
+#include "Handlers.inc"
+#undef HANDLER
+#undef NEXT
+#undef END_BLOCK
+        }
     }
-    std::ifstream input(argv[1]);
-    if (!input.is_open()) {
-        std::cerr << "Couldn't open file.\n";
-        exit(1);
+}
+
+// Direct threading: every record carries the address of its handler and each
+// handler jumps straight to the next one, so there is one indirect branch per
+// instruction and the predictor gets a separate history for each handler.
+template<class Probe>
+int VM::run_threaded(Probe& probe)
+{
+#if defined(__GNUC__)
+    static const void* const labels[] = {
+#define OPERATION(name) &&op_##name,
+#include "Operations.def"
+#undef OPERATION
+    };
+    if (handlers != labels) {
+        handlers = labels;
+        for (auto& inst : text)
+            inst.handler = labels[static_cast<size_t>(inst.op)];
+    }
+
+    RegisterFile& reg = registers;
+    const Instruction* base = text.data();
+    const uint32_t halt = static_cast<uint32_t>(text.size() - 1);
+    const uint32_t* lengths = block_length.data();
+    int64_t remaining = budget;
+    uint32_t pc = program_counter;
+    const Instruction* i;
+
+#define HANDLER(name) op_##name:
+#define NEXT() \
+    do { i = &base[pc++]; goto *i->handler; } while (0)
+#define END_BLOCK() do { CHARGE_BLOCK(); probe.enter_block(pc); NEXT(); } while (0)
+    probe.enter_block(pc);
+    NEXT();
+#include "Handlers.inc"
+#undef HANDLER
+#undef NEXT
+#undef END_BLOCK
+#else
+    return run_switch(probe);
+#endif
+}
+
+// The switch engine with a JIT tier on top: every block entry goes through
+// the JIT, which counts it and runs the compiled code once there is some.
+int VM::run_jit()
+{
+    // Compiled blocks can't report to a probe, so the interpreted ones don't.
+    NoProbe probe;
+    if (!Jit::supported())
+        return run_switch(probe);
+    if (!jit)
+        jit.reset(new Jit(*this, jit_threshold));
+
+    RegisterFile& reg = registers;
+    const Instruction* base = text.data();
+    const uint32_t halt = static_cast<uint32_t>(text.size() - 1);
+    uint32_t pc = program_counter;
+    const Instruction* i;
+
+block:
+    while (JitBlock code = jit->enter(pc))
+        JUMP(code(reg.reg, memory.data(), &hi, &lo, this));
+
+    for (;;) {
+        i = &base[pc++];
+        switch (i->op) {
+#define HANDLER(name) case Operation::name:
+#define NEXT() continue
+#define END_BLOCK() goto block
+#include "Handlers.inc"
+#undef HANDLER
+#undef NEXT
+#undef END_BLOCK
+        }
     }
-    VM vm(input);
-    return vm.execute();
 }
 
+#undef JUMP
+#undef EXIT
+#undef CHARGE_BLOCK
+
 std::ostream& operator<<(std::ostream& os, const mem_t& mem)
 {
     return os << mem.word;
 }
 
+std::string error_message(const std::exception& e)
+{
+    std::string message = e.what();
+    if (!message.empty() && message.back() == '\n')
+        message.pop_back();
+    return message;
+}
+
 std::ostream& operator<<(std::ostream& os, const RegisterFile& regfile)
 {
     for (size_t i = 0; i < 32;) {
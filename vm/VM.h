@@ -6,22 +6,18 @@
 #include <Funct.h>
 #include <Bitmask.h>
 #include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
-using inst_t = uint32_t;
+#include "GuestIO.h"
+#include "Memory.h"
+#include "Probe.h"
 
-union mem_t {
-    mem_t(uint32_t w = 0) // NOLINT
-            : word(w) { }
-
-    uint32_t word;
-    uint16_t half[2];
-    uint8_t byte[4];
-
-    operator inst_t() { return word; }
-
-    operator int() { return static_cast<int>(word); }
-};
+class Harts;
+class Jit;
 
 struct RegisterFile {
     RegisterFile() { memset(reg, 0, sizeof reg); }
@@ -39,30 +35,181 @@ struct RegisterFile {
 
 std::ostream& operator<<(std::ostream& os, const RegisterFile& regfile);
 
+struct VM;
+
+// A syscall as the engines run it, with its number in $v0. Returning true
+// leaves the engine with status as the exit status; false carries on.
+using SyscallHandler = bool (*)(VM& vm, int& status);
+
+// A syscall implemented by the embedding program. It takes its arguments from
+// the registers and leaves its results there, and works on guest memory in
+// place: guest byte addresses are offsets into memory.data(). Ranges must be
+// checked against memory.extent() first, throwing MemoryFault for the guest's
+// mistakes: syscalls run outside the fault guard, so an unchecked access
+// crashes the host. Writes to the text segment aren't seen by code already
+// decoded.
+using NativeSyscall = std::function<void(RegisterFile& registers, Memory& memory)>;
+
 std::ostream& operator<<(std::ostream& os, const mem_t& mem);
 
-class Memory : private std::vector<mem_t> {
-    using base = std::vector<mem_t>;
-public:
-    using base::vector;
-    using base::operator[];
-    using base::push_back;
-    using base::resize;
-    using base::reserve;
-    using base::size;
-    using base::capacity;
-    using base::begin;
-    using base::end;
-    size_type text_segment{0};
-    size_type data_segment{0};
-    size_type program_break{0};
-    size_type stack_segment{0};
+// What an exception from loading or running a guest says, as one line for
+// reports: some messages come with a newline of their own.
+std::string error_message(const std::exception& e);
+
+// The 64-bit product of two registers split into HI and LO, as MULT and
+// MULTU leave it.
+inline void multiply(uint32_t rs, uint32_t rt, uint32_t& hi, uint32_t& lo)
+{
+    int64_t result = int64_t{static_cast<int32_t>(rs)} * static_cast<int32_t>(rt);
+    hi = static_cast<uint32_t>(static_cast<uint64_t>(result) >> 32);
+    lo = static_cast<uint32_t>(result);
+}
+
+inline void multiply_unsigned(uint32_t rs, uint32_t rt, uint32_t& hi, uint32_t& lo)
+{
+    uint64_t result = uint64_t{rs} * rt;
+    hi = static_cast<uint32_t>(result >> 32);
+    lo = static_cast<uint32_t>(result);
+}
+
+// The quotient into LO and the remainder into HI, as DIV and DIVU leave
+// them. The architecture leaves division by zero undefined and the host
+// traps on it, so it gives a zero quotient with rs as the remainder, and
+// INT_MIN / -1 gives INT_MIN remainder 0 instead of overflowing.
+inline void divide(uint32_t rs, uint32_t rt, uint32_t& hi, uint32_t& lo)
+{
+    auto dividend = static_cast<int32_t>(rs);
+    auto divisor = static_cast<int32_t>(rt);
+    if (divisor == 0) {
+        lo = 0;
+        hi = rs;
+    } else if (divisor == -1) {
+        lo = 0u - rs;
+        hi = 0;
+    } else {
+        lo = static_cast<uint32_t>(dividend / divisor);
+        hi = static_cast<uint32_t>(dividend % divisor);
+    }
+}
+
+inline void divide_unsigned(uint32_t rs, uint32_t rt, uint32_t& hi, uint32_t& lo)
+{
+    if (rt == 0) {
+        lo = 0;
+        hi = rs;
+    } else {
+        lo = rs / rt;
+        hi = rs % rt;
+    }
+}
+
+enum class Operation : uint8_t {
+#define OPERATION(name) name,
+#include "Operations.def"
+#undef OPERATION
+};
+
+// An instruction word with every field already extracted. The immediate is
+// stored pre-extended the way its operation consumes it: zero-extended for the
+// logical immediates, shifted for LUI, the shift amount for SLL/SRL/SRA, the
+// 26-bit target for J and JAL and sign-extended for everything else. The
+// handler is only filled in while the threaded engine runs.
+struct Instruction {
+    const void* handler;
+    int32_t immediate;
+    Operation op;
+    uint8_t rs;
+    uint8_t rt;
+    uint8_t rd;
+};
+
+enum class Dispatch {
+    Switch, Threaded, Jit,
+};
+
+// Where VM::run left the guest.
+enum class RunState {
+    Running,    // inside run()
+    Yielded,    // used up its instruction budget
+    Blocked,    // waiting for input, the syscall reruns on resumption
+    Syscall,    // stopped at a syscall, which runs on resumption
+    Exited,     // finished with exit_status
 };
 
 struct VM {
     explicit VM(std::istream& input);
+    explicit VM(const std::string& path);
+    // From the contents of an executable file already in memory.
+    VM(const void* image, size_t size);
+    // Over memory that is already loaded.
+    explicit VM(Memory image);
+    // Over memory holding the same text as decoded, copying its decoded
+    // text instead of decoding it again.
+    VM(Memory image, const VM& decoded);
+    ~VM();
+    // Runs the guest to its exit, then waits for any harts it spawned.
     int execute();
 
+    // Runs the guest for a slice of about the given number of instructions,
+    // or until it exits or would block reading input. The budget is charged
+    // a whole basic block at a time as each block is entered, and the JIT
+    // tier is not used, since compiled loops never come back to be charged.
+    // With until_syscall it also stops in front of every syscall, with
+    // program_counter at it and its arguments in the registers; the next
+    // run carries it out, unless program_counter was moved past it.
+    RunState run(int64_t instructions, bool until_syscall = false);
+
+    // Starts over with another executable image, binary or text, as if newly
+    // constructed from it, but keeping the guest memory reservation, the
+    // buffers and the JIT's code space. Console I/O settings are kept;
+    // probes and statistics are detached.
+    void reset(const void* image, size_t size);
+
+    // A copy of this VM, stopped at the same point, that shares all guest
+    // memory with it copy-on-write. The first fork after the VM has run, or
+    // had its text decoded or patched, writes its touched pages into an
+    // anonymous in-memory image and maps them back over the VM's own memory,
+    // so parent and children share the image's pages from then on; later
+    // forks reuse the image without copying anything. Several threads may fork the same parent at once
+    // after prepare_fork(), as long as the parent doesn't run meanwhile.
+    // Host mappings are shared outright rather than copy-on-write. Children
+    // start with default console I/O.
+    std::unique_ptr<VM> fork();
+    void prepare_fork();
+
+    // Starts counting runtime statistics over the runs that follow; the
+    // counters live in the instrumented engines only, so like the other
+    // probes this runs the guest on the interpreter.
+    void enable_stats();
+    Statistics statistics() const;
+
+    // Runs handler for syscall number from then on, in place of the built-in
+    // with that number if there is one; an empty handler puts the built-in
+    // back. Numbers must be below syscall_limit. Forks and resets keep the
+    // handlers.
+    void register_syscall(uint32_t number, NativeSyscall handler);
+    static constexpr uint32_t syscall_limit = 4096;
+    static const std::vector<SyscallHandler>& builtin_syscalls();
+
+    Instruction decode(inst_t inst);
+    void decode_text();
+    void patch_text(size_t index);
+    void fuse_text(size_t index);
+    void measure_blocks(size_t last);
+    bool syscall(int& status);
+    bool block();
+    void dump_registers();
+    uint32_t string_length(uint32_t address);
+    void check_range(uint32_t address, uint32_t size, Memory::Access access = Memory::Access::ReadOnly);
+    void patch_range(uint32_t address, uint32_t size);
+
+    int enter();
+    template<class Probe>
+    int run_switch(Probe& probe);
+    template<class Probe>
+    int run_threaded(Probe& probe);
+    int run_jit();
+
     Opcode get_opcode(inst_t instruction)
     {
         return static_cast<Opcode>((instruction & (Bitmask<6>::value << 26)) >> 26);
@@ -130,9 +277,52 @@ struct VM {
 
     RegisterFile registers;
     Memory memory;
+    GuestIO io;
+    std::vector<Instruction> text;
+    // Instructions from each text index to the end of its basic block.
+    std::vector<uint32_t> block_length;
+    Dispatch dispatch{Dispatch::Threaded};
+    bool fuse{true};
+    uint32_t jit_threshold{1000};
+    std::unique_ptr<Jit> jit;
+    // Instruments to run the guest under; while any is set the guest runs on
+    // the interpreter.
+    Probes probes;
+    std::unique_ptr<Stats> stats;
+    const void* const* handlers{nullptr};
+    // Handlers by syscall number, with unknown numbers below the largest
+    // known one doing nothing, and the embedding program's handlers that
+    // entries forward to.
+    std::vector<SyscallHandler> syscalls{builtin_syscalls()};
+    std::vector<NativeSyscall> native_syscalls;
     uint32_t hi{0};
     uint32_t lo{0};
     uint32_t program_counter{0};
+    int64_t budget{INT64_MAX};
+    bool cooperative{false};
+    bool stop_at_syscall{false};
+    static constexpr uint32_t no_syscall = UINT32_MAX;
+    uint32_t stopped_syscall{no_syscall};   // text index run() last stopped at
+    RunState state{RunState::Running};
+    int exit_status{0};
+    // Why the VM stopped the guest, when it didn't exit by itself: reported
+    // next to the exit status the way a fault's message is.
+    std::string error;
+    static constexpr uint32_t no_link = UINT32_MAX;
+    uint32_t link_address{no_link};     // of the last LL, until the next SC
+    uint32_t link_value{0};
+    // The guest's harts once it spawns any, owned by hart 0, the VM that
+    // loaded the program, and this VM's id among them.
+    std::unique_ptr<Harts> spawned;
+    Harts* harts{nullptr};
+    uint32_t hart{0};
+
+private:
+    // The image forks map their memory from, and whether it still holds
+    // this VM as it stands: running the VM or decoding or patching its text
+    // makes prepare_fork() write a new one.
+    int fork_image{-1};
+    bool fork_image_current{false};
 };
 
 #endif //MIPS_VM_H
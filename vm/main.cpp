@@ -0,0 +1,214 @@
+#include <climits>
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <unistd.h>
+#include "Batch.h"
+#include "Profiler.h"
+#include "Snapshot.h"
+#include "StackSampler.h"
+#include "Symbols.h"
+#include "VM.h"
+
+static void usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [--dispatch=switch|threaded|jit] [--jit-threshold=N] [--no-fuse] [--huge-pages]\n"
+              << "       " << std::string(strlen(name), ' ') << " [--profile[=output]] [--flamegraph[=output]] [--sample-every=N]\n"
+              << "       " << std::string(strlen(name), ' ') << " [--stats[=output]] [--trace[=output]] [--cache[=l1i|l1d|l2=size:ways:line,...]]\n"
+              << "       " << std::string(strlen(name), ' ') << " [--pipeline] file|snapshot\n"
+              << "       " << name << " [options] --batch=manifest [--jobs=N | --interleave=instructions] [--batch-bench]\n";
+    exit(1);
+}
+
+// Reports what stopped the guest, or kept it from starting, and returns the
+// exit status for it.
+static int fail(const std::exception& e)
+{
+    std::cerr << error_message(e) << '\n';
+    return 1;
+}
+
+// Reports why the VM stopped the guest, if it did, and passes its exit
+// status on.
+static int finished(const VM& vm, int status)
+{
+    if (!vm.error.empty())
+        std::cerr << vm.error << '\n';
+    return status;
+}
+
+int main(int argc, char** argv)
+{
+    const char* file = nullptr;
+    RunOptions options;
+    std::string manifest;
+    unsigned jobs = std::thread::hardware_concurrency();
+    bool bench = false;
+    int64_t slice = 0;
+    bool profile = false;
+    std::string profile_path;
+    bool flamegraph = false;
+    std::string flamegraph_path;
+    uint64_t period = 1000;
+    bool stats = false;
+    std::string stats_path;
+    bool trace = false;
+    std::string trace_path;
+    bool cache = false;
+    bool pipeline = false;
+    CacheModel::Config cache_config;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (options.parse(arg))
+            continue;
+        else if (arg == "--huge-pages")
+            Memory::huge_pages = true;
+        else if (arg.compare(0, 8, "--batch=") == 0)
+            manifest = arg.substr(8);
+        else if (arg.compare(0, 7, "--jobs=") == 0) {
+            jobs = static_cast<unsigned>(parse_count(arg.substr(7), UINT_MAX));
+            if (!jobs)
+                usage(argv[0]);
+        } else if (arg == "--profile")
+            profile = true;
+        else if (arg.compare(0, 10, "--profile=") == 0) {
+            profile = true;
+            profile_path = arg.substr(10);
+        } else if (arg == "--flamegraph")
+            flamegraph = true;
+        else if (arg.compare(0, 13, "--flamegraph=") == 0) {
+            flamegraph = true;
+            flamegraph_path = arg.substr(13);
+        } else if (arg == "--stats")
+            stats = true;
+        else if (arg.compare(0, 8, "--stats=") == 0) {
+            stats = true;
+            stats_path = arg.substr(8);
+        } else if (arg == "--trace")
+            trace = true;
+        else if (arg.compare(0, 8, "--trace=") == 0) {
+            trace = true;
+            trace_path = arg.substr(8);
+        } else if (arg == "--cache")
+            cache = true;
+        else if (arg.compare(0, 8, "--cache=") == 0) {
+            cache = true;
+            try {
+                cache_config.parse(arg.substr(8));
+            } catch (std::invalid_argument& e) {
+                std::cerr << e.what() << '\n';
+                usage(argv[0]);
+            }
+        } else if (arg == "--pipeline")
+            pipeline = true;
+        else if (arg.compare(0, 15, "--sample-every=") == 0) {
+            period = parse_count(arg.substr(15), UINT64_MAX);
+            if (!period)
+                usage(argv[0]);
+        } else if (arg == "--batch-bench")
+            bench = true;
+        else if (arg.compare(0, 13, "--interleave=") == 0) {
+            slice = static_cast<int64_t>(parse_count(arg.substr(13), INT64_MAX));
+            if (!slice)
+                usage(argv[0]);
+        } else if (!file && arg[0] != '-')
+            file = argv[i];
+        else
+            usage(argv[0]);
+    }
+
+    if (!manifest.empty()) {
+        if (file)
+            usage(argv[0]);
+        std::ifstream input(manifest);
+        if (!input) {
+            std::cerr << "Couldn't open file.\n";
+            exit(1);
+        }
+        try {
+            Batch batch(input, options);
+            if (bench) {
+                batch.benchmark(jobs ? jobs : 1, std::cout);
+                return 0;
+            }
+            if (slice > 0)
+                batch.interleave(slice, &std::cout);
+            else
+                batch.run(jobs, &std::cout);
+            return batch.status();
+        } catch (const std::exception& e) {
+            return fail(e);
+        }
+    }
+
+    if (!file)
+        usage(argv[0]);
+    if (access(file, R_OK) != 0) {
+        std::cerr << "Couldn't open file.\n";
+        exit(1);
+    }
+    std::unique_ptr<VM> vm;
+    try {
+        vm = is_snapshot(file) ? load_snapshot(file) : std::unique_ptr<VM>(new VM(std::string(file)));
+        options.apply(*vm);
+        if (!profile && !flamegraph && !stats && !trace && !cache && !pipeline)
+            return finished(*vm, vm->execute());
+    } catch (const std::exception& e) {
+        return fail(e);
+    }
+
+    Profiler profiler(*vm);
+    StackSampler sampler(vm->block_length, vm->program_counter, period);
+    if (profile)
+        vm->probes.profiler = &profiler;
+    if (flamegraph)
+        vm->probes.sampler = &sampler;
+    if (stats)
+        vm->enable_stats();
+    std::unique_ptr<Tracer> tracer;
+    if (trace) {
+        tracer.reset(new Tracer(*vm, trace_path.empty() ? std::string(file) + ".trace" : trace_path));
+        vm->probes.tracer = tracer.get();
+    }
+    std::unique_ptr<CacheModel> cache_model;
+    if (cache) {
+        cache_model.reset(new CacheModel(*vm, cache_config));
+        vm->probes.cache = cache_model.get();
+    }
+    PipelineModel pipeline_model(*vm);
+    if (pipeline)
+        vm->probes.pipeline = &pipeline_model;
+    int status;
+    try {
+        status = finished(*vm, vm->execute());
+    } catch (const std::exception& e) {
+        // Keep the trace up to the fault, which is when it matters most.
+        if (tracer)
+            tracer->finish();
+        return fail(e);
+    }
+    if (tracer)
+        tracer->finish();
+    if (cache_model)
+        cache_model->report(std::cerr);
+    if (pipeline)
+        pipeline_model.report(std::cerr, Symbols::load(std::string(file) + ".sym"));
+    if (profile) {
+        profiler.report(std::cerr);
+        std::ofstream output(profile_path.empty() ? std::string(file) + ".profile" : profile_path);
+        profiler.write(output);
+    }
+    if (flamegraph) {
+        std::ofstream output(flamegraph_path.empty() ? std::string(file) + ".folded" : flamegraph_path);
+        sampler.write(output, Symbols::load(std::string(file) + ".sym"));
+    }
+    if (stats) {
+        if (stats_path.empty()) {
+            vm->statistics().write_json(std::cerr);
+        } else {
+            std::ofstream output(stats_path);
+            vm->statistics().write_json(output);
+        }
+    }
+    return status;
+}
@@ -0,0 +1,90 @@
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <Funct.h>
+#include <Opcode.h>
+
+#include "Trace.h"
+
+// Prints a trace written by `vm --trace`, one executed instruction per line:
+// its address, the instruction word, its mnemonic and, for loads and
+// stores, the address accessed.
+
+static void usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [--skip=N] [--count=N] trace\n";
+    exit(1);
+}
+
+static void print(std::ostream& os, const TraceRecord& record)
+{
+    auto opcode = static_cast<Opcode>(record.word >> 26);
+    std::ostringstream mnemonic;
+    if (opcode == Opcode::R_TYPE)
+        mnemonic << static_cast<Funct>(record.word & 0x3F);
+    else
+        mnemonic << opcode;
+
+    os << std::hex << std::setfill('0')
+       << std::setw(8) << record.address << "  " << std::setw(8) << record.word << "  ";
+    if (opcode >= Opcode::LB && opcode <= Opcode::SWR)
+        os << std::left << std::setfill(' ') << std::setw(8) << mnemonic.str() << std::right
+           << std::setfill('0') << std::setw(8) << record.effective;
+    else
+        os << mnemonic.str();
+    os << std::dec << std::setfill(' ') << '\n';
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = nullptr;
+    uint64_t skip = 0;
+    uint64_t count = UINT64_MAX;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg.compare(0, 7, "--skip=") == 0)
+            skip = std::stoull(arg.substr(7));
+        else if (arg.compare(0, 8, "--count=") == 0)
+            count = std::stoull(arg.substr(8));
+        else if (arg[0] == '-' || path)
+            usage(argv[0]);
+        else
+            path = argv[i];
+    }
+    if (!path)
+        usage(argv[0]);
+
+    FILE* input = fopen(path, "rb");
+    if (!input) {
+        std::cerr << "failed to open file " << path << '\n';
+        return 2;
+    }
+    TraceHeader header;
+    if (fread(&header, sizeof header, 1, input) != 1
+        || header.magic != TraceHeader::magic_value
+        || header.version != TraceHeader::current_version
+        || header.record_size != sizeof(TraceRecord)) {
+        std::cerr << path << " is not a trace\n";
+        return 2;
+    }
+
+    std::vector<TraceRecord> records(4096);
+    uint64_t index = 0;
+    while (count > 0) {
+        size_t got = fread(records.data(), sizeof(TraceRecord), records.size(), input);
+        if (got == 0)
+            break;
+        for (size_t n = 0; n < got && count > 0; ++n, ++index) {
+            if (index < skip)
+                continue;
+            print(std::cout, records[n]);
+            count -= 1;
+        }
+    }
+    fclose(input);
+    return 0;
+}